@@ -18,3 +18,5 @@ extern inline void flush(void);
 #define SYS_READFILE  5
 #define SYS_WRITEFILE 6
 #define SYS_YIELD     7
+#define SYS_FORK      8
+#define SYS_SBRK      9
@@ -14,6 +14,9 @@ enum StreamDirection : uint8_t {
     STREAM_IN
 };
 
+// Must divide 65536, so that the read/write indices can wrap around.
+#define STREAM_BUFFER_SIZE 1024
+
 struct stream {
     struct stream *target;
     char *buffer;
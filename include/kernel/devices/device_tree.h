@@ -1,5 +1,6 @@
 #pragma once
 
+#include <memory/page_allocator.h>
 #include <stddef.h>
 
 typedef struct fdt_header {
@@ -15,6 +16,8 @@ typedef struct fdt_header {
     uint32_t size_dt_struct;
 } fdt_header;
 
+// Finds physical RAM and reserved regions. Safe to call before any allocator is initialized.
+void device_tree_memory_map(const fdt_header *fdt, struct memory_map *map);
 void device_tree_init(const fdt_header *fdt);
 
 void inspect_device_tree(const fdt_header *fdt);
@@ -46,7 +46,9 @@ struct pci_ll {
     struct pci_device device;
 } __attribute__((packed));
 
-void probe_pci(paddr_t base);
+// Creates the caches PCI enumeration allocates from. Must be called once, before the device tree is walked.
+void init_pci(void);
+void probe_pci(paddr_t base, uint32_t);
 
 struct pci_driver {
     uint16_t vendor_id, device_id;
@@ -4,7 +4,12 @@
 
 #include <stddef.h>
 
+// Interrupt sources beyond this can't be registered (QEMU's `virt` machine has 96).
+#define PLIC_MAX_IRQS 128
+
 void plic_enable(int irq_num);
-void plic_init(paddr_t);
+// Enables `irq` on this hart, and has `plic_interrupt()` call `handler(data)` whenever it's raised.
+void plic_register(int irq, void (*handler)(void *), void *data);
+void plic_init(paddr_t, uint32_t);
 void plic_interrupt();
 extern paddr_t plic_base;
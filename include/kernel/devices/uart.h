@@ -6,7 +6,7 @@
 
 extern struct spinlock uart_tx_lock;
 
-void uart_init(paddr_t);
+void uart_init(paddr_t, uint32_t);
 void uart_pump(void);
 int uart_getc(void);
 void uartputc_sync(char);
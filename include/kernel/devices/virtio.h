@@ -5,31 +5,62 @@
 #include <stddef.h>
 
 #include <io.h>
+#include <spinlock.h>
 
-#define VIRTQ_ENTRY_NUM            16
-#define VIRTIO_DEVICE_BLK          2
+// Virtqueues get as many entries as their device takes, up to this many. Must be a power of two.
+#ifndef VIRTQ_MAX_ENTRIES
+#define VIRTQ_MAX_ENTRIES 256
+#endif
+
+#define VIRTIO_DEVICE_BLK            2
 // #define VIRTIO_BLK_PADDR           0x10001000
-#define VIRTIO_REG_MAGIC           0x00
-#define VIRTIO_REG_VERSION         0x04
-#define VIRTIO_REG_DEVICE_ID       0x08
-#define VIRTIO_REG_QUEUE_SEL       0x30
-#define VIRTIO_REG_QUEUE_NUM_MAX   0x34
-#define VIRTIO_REG_QUEUE_NUM       0x38
-#define VIRTIO_REG_QUEUE_ALIGN     0x3c
-#define VIRTIO_REG_QUEUE_PFN       0x40
-#define VIRTIO_REG_QUEUE_READY     0x44
-#define VIRTIO_REG_QUEUE_NOTIFY    0x50
-#define VIRTIO_REG_DEVICE_STATUS   0x70
-#define VIRTIO_REG_DEVICE_CONFIG   0x100
-#define VIRTIO_STATUS_ACK          1
-#define VIRTIO_STATUS_DRIVER       2
-#define VIRTIO_STATUS_DRIVER_OK    4
-#define VIRTIO_STATUS_FEAT_OK      8
-#define VIRTQ_DESC_F_NEXT          1
-#define VIRTQ_DESC_F_WRITE         2
-#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
-#define VIRTIO_BLK_T_IN            0
-#define VIRTIO_BLK_T_OUT           1
+#define VIRTIO_REG_MAGIC             0x00
+#define VIRTIO_REG_VERSION           0x04
+#define VIRTIO_REG_DEVICE_ID         0x08
+#define VIRTIO_REG_DEVICE_FEATURES   0x10
+#define VIRTIO_REG_DEVICE_FEAT_SEL   0x14
+#define VIRTIO_REG_DRIVER_FEATURES   0x20
+#define VIRTIO_REG_DRIVER_FEAT_SEL   0x24
+#define VIRTIO_REG_QUEUE_SEL         0x30
+#define VIRTIO_REG_QUEUE_NUM_MAX     0x34
+#define VIRTIO_REG_QUEUE_NUM         0x38
+#define VIRTIO_REG_QUEUE_ALIGN       0x3c
+#define VIRTIO_REG_QUEUE_PFN         0x40
+#define VIRTIO_REG_QUEUE_READY       0x44
+#define VIRTIO_REG_QUEUE_NOTIFY      0x50
+#define VIRTIO_REG_INTERRUPT_STATUS  0x60
+#define VIRTIO_REG_INTERRUPT_ACK     0x64
+#define VIRTIO_REG_DEVICE_STATUS     0x70
+// Version 2 (non-legacy) only.
+#define VIRTIO_REG_QUEUE_DESC_LOW    0x80
+#define VIRTIO_REG_QUEUE_DESC_HIGH   0x84
+#define VIRTIO_REG_QUEUE_DRIVER_LOW  0x90
+#define VIRTIO_REG_QUEUE_DRIVER_HIGH 0x94
+#define VIRTIO_REG_QUEUE_DEVICE_LOW  0xa0
+#define VIRTIO_REG_QUEUE_DEVICE_HIGH 0xa4
+#define VIRTIO_REG_CONFIG_GENERATION 0xfc
+#define VIRTIO_REG_DEVICE_CONFIG     0x100
+#define VIRTIO_STATUS_ACK            1
+#define VIRTIO_STATUS_DRIVER         2
+#define VIRTIO_STATUS_DRIVER_OK      4
+#define VIRTIO_STATUS_FEAT_OK        8
+#define VIRTIO_STATUS_FAILED         128
+#define VIRTQ_DESC_F_NEXT            1
+#define VIRTQ_DESC_F_WRITE           2
+#define VIRTQ_DESC_F_INDIRECT        4
+#define VIRTQ_AVAIL_F_NO_INTERRUPT   1
+#define VIRTQ_USED_F_NO_NOTIFY       1
+#define VIRTIO_BLK_T_IN              0
+#define VIRTIO_BLK_T_OUT             1
+// Feature bits: the device offers them, and the driver accepts those it understands.
+#define VIRTIO_BLK_F_SIZE_MAX        1
+#define VIRTIO_BLK_F_SEG_MAX         2
+#define VIRTIO_BLK_F_BLK_SIZE        6
+#define VIRTIO_BLK_F_TOPOLOGY        10
+#define VIRTIO_RING_F_INDIRECT_DESC  28
+#define VIRTIO_F_EVENT_IDX           29
+#define VIRTIO_F_VERSION_1           32
+#define VIRTIO_FEATURE(BIT)          (1ull << (BIT))
 
 enum VIRTIO_DEVICE_IDS {
     VIRTIO_DEVICE_NETWORK_CARD = 1,
@@ -68,7 +99,7 @@ struct virtq_desc {
 struct virtq_avail {
     uint16_t flags;
     uint16_t index;
-    uint16_t ring[VIRTQ_ENTRY_NUM];
+    uint16_t ring[]; // Followed by `used_event`.
 } __attribute__((packed));
 
 // Virtqueue Used Ring entry.
@@ -81,30 +112,78 @@ struct virtq_used_elem {
 struct virtq_used {
     uint16_t flags;
     uint16_t index;
-    struct virtq_used_elem ring[VIRTQ_ENTRY_NUM];
+    struct virtq_used_elem ring[]; // Followed by `avail_event`.
 } __attribute__((packed));
 
 // NOLINTBEGIN
-// Virtqueue.
-struct __attribute__((packed)) virtio_virtq {
-    struct virtq_desc descs[VIRTQ_ENTRY_NUM];
-    struct virtq_avail avail;
-    struct virtq_used used __attribute__((aligned(PAGE_SIZE)));
+// Virtqueue. Its areas are laid out one after another as legacy devices expect, with the used ring page-aligned.
+struct virtio_virtq {
+    struct virtq_desc *descs;
+    struct virtq_avail *avail;
+    struct virtq_used *used;
+    uint16_t num; // Entries in each area, as agreed with the device.
     int queue_index;
     volatile uint16_t *used_index;
-    uint16_t last_used_index;
+    // With `VIRTIO_F_EVENT_IDX`: the device interrupts once it has used entry `*used_event` (which is after the
+    // available ring's entries), and wants notifying once entry `*avail_event` (after the used ring's) is available.
+    volatile uint16_t *used_event, *avail_event;
+    uint16_t last_used_index; // The next entry of the used ring to process.
+    // Unused descriptors, chained through their `next` fields.
+    uint16_t free_head;
+    uint16_t num_free;
 };
 // NOLINTEND
 
-// Virtio-blk request.
-struct virtio_blk_req {
+// Most sectors moved by a single request (devices may want fewer); longer reads and writes are split up.
+#define VIRTIO_BLK_MAX_SECTORS 128
+// Each request is a chain of a header, a data and a status descriptor.
+#define VIRTIO_BLK_DESCS_PER_REQ 3
+// Most data segments in a request's indirect descriptor table, which is a page alongside its header and status.
+#define VIRTIO_BLK_MAX_SEGMENTS  (PAGE_SIZE / sizeof(struct virtq_desc) - 2)
+// Buffers in RAM aligned to this are handed to the device as they are; anything else goes through a bounce buffer.
+#define VIRTIO_BLK_DMA_ALIGN 4
+
+// Virtio-blk request header, as the device reads it.
+struct virtio_blk_req_header {
     uint32_t type;
     uint32_t reserved;
     uint64_t sector;
-    uint8_t data[512];
-    uint8_t status;
 } __attribute__((packed));
 
+// Virtio-blk device configuration, at `VIRTIO_REG_DEVICE_CONFIG`. Fields after `capacity` are only valid if their
+// feature was negotiated.
+struct virtio_blk_config {
+    uint64_t capacity; // In sectors.
+    uint32_t size_max; // `VIRTIO_BLK_F_SIZE_MAX`: largest segment, in bytes.
+    uint32_t seg_max;  // `VIRTIO_BLK_F_SEG_MAX`: most segments per request.
+    struct {
+        uint16_t cylinders;
+        uint8_t heads;
+        uint8_t sectors;
+    } geometry;
+    uint32_t blk_size; // `VIRTIO_BLK_F_BLK_SIZE`: logical block size, in bytes.
+    // `VIRTIO_BLK_F_TOPOLOGY`
+    struct {
+        uint8_t physical_block_exp; // Logical blocks per physical block, as a power of two.
+        uint8_t alignment_offset;   // Offset of the first aligned logical block.
+        uint16_t min_io_size;       // In logical blocks.
+        uint32_t opt_io_size;       // In logical blocks.
+    } topology;
+};
+
+// A virtio-blk request slot, one per descriptor that can head a request's chain.
+struct virtio_blk_req {
+    struct virtio_blk_req_header header;
+    uint8_t status; // Written by the device.
+    bool is_write;
+    volatile bool done; // The device has used the request, and (for reads) `buf` is filled.
+    void *buf;
+    uint32_t bytes;
+    uint8_t *data;   // What the device transfers to/from: `buf` itself, or `bounce`.
+    uint8_t *bounce; // Pages covering `bytes`, if the request needs them. Freed once it has been waited for.
+    struct virtq_desc *indirect; // A page-sized descriptor table, if the request has one. Freed along with `bounce`.
+};
+
 // #define DISK_MAX_SIZE align_up(sizeof(struct file) * FILES_MAX, SECTOR_SIZE)
 // #define DISK_MAX_SIZE align_up(4194304, SECTOR_SIZE)
 
@@ -113,6 +192,8 @@ struct virtio_device {
     paddr_t base_addr;
     struct virtio_virtq *queue;
     enum VIRTIO_DEVICE_IDS device_type;
+    uint32_t version;  // Of the MMIO transport: 1 is legacy.
+    uint64_t features; // Negotiated with the device.
 };
 
 struct virtio_blk_device {
@@ -120,11 +201,40 @@ struct virtio_blk_device {
     // INHERITS(struct virtio_device);
     struct virtio_device virtio;
     // struct virtio_device virtio;
-    struct virtio_blk_req *requests;
+    struct virtio_blk_req *requests; // Indexed by head descriptor.
+    struct spinlock lock;            // Guards the queue and `requests`.
     uint32_t sector_count;
+    // Requests are split at no more than this many sectors, and in multiples of the device's optimal I/O size.
+    uint32_t max_sectors;
+    uint32_t blk_size; // The device's logical block size, in bytes.
+    uint32_t seg_max;  // Most data segments the device takes per request, or 0 if it didn't say.
+    // Most data segments this driver puts in an indirect request, or 0 if the device can't take indirect requests.
+    uint32_t max_segments;
+    uint32_t irq;      // Completions are reaped by the interrupt handler, unless this is 0.
+    uint32_t irq_hart; // The hart the PLIC delivers `irq` to.
+    // Bytes transferred straight to/from callers' buffers, and through bounce buffers.
+    uint64_t direct_bytes, bounced_bytes;
 };
 
-struct virtio_blk_device *virtio_blk_init(paddr_t);
-void read_write_disk(struct virtio_blk_device *dev, void *buf, unsigned sector, int is_write);
+struct virtio_blk_device *virtio_blk_init(paddr_t, uint32_t irq);
+// Queues a request to read/write `count` consecutive sectors (up to `max_sectors`) starting at `sector`,
+// without waiting for it. Returns the request's id, or -1 if the queue has no room for it (or it's out of range).
+int virtio_blk_submit(struct virtio_blk_device *dev, void *buf, unsigned sector, unsigned count, int is_write);
+// Completes everything the device has finished with, in whatever order it finished them.
+void virtio_blk_reap(struct virtio_blk_device *dev);
+// Waits for request `id` to complete and frees its slot (and descriptors). Every submitted request must be waited for.
+// Yields to other processes (or sleeps) while the interrupt handler completes it, or polls when that can't happen.
+// Returns whether it succeeded.
+bool virtio_blk_wait(struct virtio_blk_device *dev, int id);
+// Reads/writes `count` consecutive sectors (up to `max_sectors`) starting at `sector`, as one request.
+bool read_write_disk(struct virtio_blk_device *dev, void *buf, unsigned sector, unsigned count, int is_write);
+// Reads each of `runs`, with as few requests and notifications as it can: a run shares a request with any runs after it
+// that carry on from it on disk, each request listing its segments in an indirect descriptor table. Returns how many
+// sectors were read.
+size_t virtio_read_blocks(const struct block_device *dev, const struct block_run *runs, size_t num_runs);
+// Times sequential reads from the start of `dev` one sector per request against whole ranges per request.
+void virtio_blk_bench(struct block_device *dev);
 
-void probe_virtio_device(paddr_t location);
+void probe_virtio_device(paddr_t location, uint32_t irq);
+// The MMIO window spanning every virtio device in the device tree, or `0`-`0` if there are none.
+extern paddr_t virtio_mmio_start, virtio_mmio_end;
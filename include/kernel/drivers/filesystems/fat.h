@@ -25,4 +25,6 @@ struct fat_file {
     uint32_t start_cluster;
 };
 
+// Creates the caches FAT filesystems allocate from. Must be called once, before the first `fat_init()`.
+void init_fat(void);
 bool fat_init(const struct block_device *dev, struct block *base);
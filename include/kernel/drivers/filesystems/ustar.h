@@ -8,6 +8,7 @@ struct ustar_filesystem {
 
 struct ustar_file {
     INHERITS(struct file);
+    uint32_t data_block; // First block of the file's contents, right after its header.
 };
 
 struct tar_header {
@@ -32,4 +33,6 @@ struct tar_header {
                  // (flexible array member)
 } __attribute__((packed));
 
+// Creates the caches USTAR filesystems allocate from. Must be called once, before the first `ustar_init()`.
+void init_ustar(void);
 bool ustar_init(struct block_device *dev, struct block *block);
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <console.h>
+#include <memory/page_allocator.h>
+#include <memory/slab_allocator.h>
 #include <process.h>
 #include <stddef.h>
 
@@ -18,6 +20,9 @@ typedef struct hart_local {
     struct stream *stdout;
     process *idle_proc;
     process *current_proc;
+    struct page_magazine pages;
+    struct slab_magazine slabs[SLAB_SIZE_COUNT];
+    bool tlb_stale; // Set when the ASID generation rolls over; the next address-space switch flushes the whole TLB.
 } hart_local;
 
 extern hart_local heart_locals[MAX_HARTS];
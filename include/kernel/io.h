@@ -16,12 +16,16 @@
 #define IO_DBG(...)
 #endif
 
+struct file;
 struct filesystem {
     const struct filesystem *next;
     const struct block_device *device;
     const char *type_name;
     uint32_t base_sector;
     size_t (*read_file)(struct filesystem *, void *restrict, char (*name)[MAX_FILENAME_LENGTH]);
+    // Reads up to `length` bytes of `file`, starting `offset` bytes in. Returns how many were read (fewer at the end of
+    // the file, or if the device or the filesystem's own structures let it down).
+    size_t (*read_file_at)(struct filesystem *, const struct file *, void *restrict, size_t offset, size_t length);
 };
 extern inline void add_filesystem(struct filesystem *);
 
@@ -54,10 +58,18 @@ struct device {
     struct device *next;
 };
 
+// One piece of a vectored read: `num_blocks` consecutive blocks from `start_block`, into `buffer`.
+struct block_run {
+    void *buffer;
+    size_t start_block, num_blocks;
+};
+
 struct block_device {
     INHERITS(struct device);
     char *id;
     size_t (*read_block)(const struct block_device *dev, void *restrict buffer, size_t start_block, size_t num_blocks);
+    // Reads a whole list of runs in one go. Optional, see `read_block_runs()`.
+    size_t (*read_blocks)(const struct block_device *dev, const struct block_run *runs, size_t num_runs);
 };
 
 struct block {
@@ -67,6 +79,8 @@ struct block {
 
 extern struct block_device *block_device_chain_head;
 extern inline void add_block_device(struct block_device *);
+// Reads all of `runs` from `dev`, in one go if it can, or else one at a time. Returns how many blocks were read.
+size_t read_block_runs(const struct block_device *dev, const struct block_run *runs, size_t num_runs);
 void fs_init(struct block_device *dev);
 static inline void fs_flush(struct block_device *dev);
 struct file *fs_lookup(const char *);
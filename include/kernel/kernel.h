@@ -6,9 +6,15 @@
 #include <color.h>
 #include <console.h>
 
-#define PAGE_SIZE 4096
+#define PAGE_SIZE       4096
+#define CACHE_LINE_SIZE 64
 
-#define WAIT_FOR_INTERRUPT() __asm__("wfi" : : :);
+#define WAIT_FOR_INTERRUPT()   __asm__("wfi" : : :);
+#define SFENCE_VMA_ALL()       __asm__ __volatile__("sfence.vma" : : : "memory")
+#define SFENCE_VMA_ASID(asid)  __asm__ __volatile__("sfence.vma zero, %0" : : "r"(asid) : "memory")
+#define SFENCE_VMA_PAGE(vaddr) __asm__ __volatile__("sfence.vma %0" : : "r"(vaddr) : "memory")
+#define SFENCE_VMA_PAGE_ASID(vaddr, asid)                                                                              \
+    __asm__ __volatile__("sfence.vma %0, %1" : : "r"(vaddr), "r"(asid) : "memory")
 
 extern uint32_t CLOCK_FREQ;
 
@@ -93,17 +99,32 @@ struct trap_frame {
         }                                                                                                              \
     } while (0)
 
+#define SATP_ASID_SHIFT 22
+#define SATP_ASID_MASK  (0x1ffu << SATP_ASID_SHIFT)
+
 #define SATP_SV32 (1u << 31)
 #define PAGE_V    (1 << 0) // "Valid" bit (entry is enabled)
 #define PAGE_R    (1 << 1) // Readable
 #define PAGE_W    (1 << 2) // Writable
 #define PAGE_X    (1 << 3) // Executable
 #define PAGE_U    (1 << 4) // User (accessible in user mode)
+#define PAGE_G    (1 << 5) // Global (present in every address space)
+#define PAGE_COW  (1 << 8) // Copy-on-write (software-defined "RSW" bit, ignored by the MMU)
+
+#define USER_BASE     0x1000000
+#define SSTATUS_SPIE  (1 << 5)
+#define SSTATUS_SPP   (1 << 8)
+#define SSTATUS_SUM   (1 << 18)
+#define SCOUNTEREN_TM (1 << 1) // User mode may read the `time` CSR
+#define SCAUSE_ECALL  8
+
+// The heap grown by `SYS_SBRK` starts just past the largest image `user.ld` allows, and stays clear of MMIO.
+#define USER_HEAP_BASE 0x1800000
+#define USER_HEAP_END  0x8000000
 
-#define USER_BASE    0x1000000
-#define SSTATUS_SPIE (1 << 5)
-#define SSTATUS_SUM  (1 << 18)
-#define SCAUSE_ECALL 8
+#define SCAUSE_INSTRUCTION_PAGE_FAULT 12
+#define SCAUSE_LOAD_PAGE_FAULT        13
+#define SCAUSE_STORE_PAGE_FAULT       15
 
 void sbi_putc(char c);
 int sbi_getc();
@@ -2,4 +2,90 @@
 
 #include <stddef.h>
 
-paddr_t alloc_pages(uint32_t n);
\ No newline at end of file
+// Largest block handed out by the buddy allocator is `1 << PAGE_MAX_ORDER` pages (4MiB).
+#define PAGE_MAX_ORDER 10
+
+// Each hart keeps up to `PAGE_MAGAZINE_SIZE` free pages of its own, and refills/drains them `PAGE_MAGAZINE_BATCH` at
+// a time from the global free lists.
+#define PAGE_MAGAZINE_SIZE  32
+#define PAGE_MAGAZINE_BATCH (PAGE_MAGAZINE_SIZE / 2)
+
+// Up to this many pre-zeroed pages are kept in a global pool.
+#define PAGE_CLEAN_POOL_SIZE 128
+
+struct page_magazine {
+    uint32_t count;
+    paddr_t pages[PAGE_MAGAZINE_SIZE];
+    uint32_t hits, misses; // Single-page allocations served from (or not from) the magazine.
+};
+
+// Up to this many RAM ranges and reserved ranges are taken from the device tree.
+#define MEMORY_MAP_MAX_RANGES 16
+
+struct memory_range {
+    paddr_t start, end;
+};
+
+// Physical memory as described by the device tree (see `device_tree_memory_map()`).
+struct memory_map {
+    size_t ram_count, reserved_count;
+    struct memory_range ram[MEMORY_MAP_MAX_RANGES];
+    struct memory_range reserved[MEMORY_MAP_MAX_RANGES]; // Firmware, `/memreserve/`s, and the FDT blob itself.
+};
+
+enum page_state : uint8_t {
+    PG_ALLOCATED, // In use, or somewhere inside a larger free block.
+    PG_FREE,      // First frame of a free block of `1 << order` frames.
+    PG_MAGAZINE,  // Cached in a hart's page magazine.
+    PG_CLEAN,     // Zeroed and waiting in the clean pool.
+    PG_RESERVED,  // Not ours to hand out: firmware, the kernel image, the frame table, the FDT, or a hole.
+    PG_SLAB,      // Allocated, and part of a slab cache.
+    PG_LARGE,     // Allocated, and the first frame of a large `kmalloc()` block.
+};
+
+// Per-frame metadata, one for every 4KiB frame of physical RAM.
+struct page {
+    enum page_state state;
+    uint8_t order; // Of a free block, or the size class (`enum slab_index`) of a `PG_SLAB` frame's cache.
+    union {
+        uint16_t refs;  // Mappings of an allocated frame beyond the first, see `page_get()`.
+        uint16_t pages; // Length of a `PG_LARGE` block.
+    };
+};
+
+// Bounds of physical RAM, as discovered from the device tree.
+extern paddr_t ram_start, ram_end;
+
+void init_page_allocator(const struct memory_map *map);
+
+// Allocates `n` physically contiguous, zeroed pages. Each page may later be returned individually with `free_pages`.
+// When `n` is a power of two, the block is naturally aligned to `n * PAGE_SIZE`.
+paddr_t alloc_pages(uint32_t n);
+void free_pages(paddr_t paddr, uint32_t n);
+
+// Reference counting for single pages shared between address spaces (e.g. copy-on-write after `fork`). A freshly
+// allocated page has one reference; `page_put()` drops one and frees the page along with the last.
+void page_get(paddr_t paddr);
+void page_put(paddr_t paddr);
+// Whether anyone other than the caller still holds a reference to the page at `paddr`.
+bool page_shared(paddr_t paddr);
+
+// Marks allocated pages as holding a slab cache of the given size class, or as a large `kmalloc()` block of `n` pages,
+// so that `kfree()` can tell how an object was allocated. `free_pages()` clears the marks.
+void page_mark_slab(paddr_t paddr, uint32_t n, uint8_t size_class);
+void page_mark_large(paddr_t paddr, uint32_t n);
+// The metadata of the page containing `paddr`.
+struct page page_info(paddr_t paddr);
+
+// Zeroes one free page into the pool of pre-zeroed pages that single-page allocations are served from first. Meant to
+// be called by idle harts. Returns `false` once the pool is full (or there is no free memory left to zero).
+bool zero_free_page(void);
+
+size_t free_page_count(void);
+void page_magazine_dbg(void);
+
+#ifdef TESTS
+
+void page_test_suite(void);
+
+#endif
@@ -3,9 +3,13 @@
 #include <kernel.h>
 #include <memory/page_allocator.h>
 #include <memory/slab_allocator.h>
+#include <spinlock.h>
 #include <util.h>
 
-#define SLAB(SIZE)                                                                                                     \
+// Enough bitmap words for one bit per object a cache of `PAGES` pages could possibly hold.
+#define SLAB_BITMAP_WORDS(SIZE, PAGES) (((PAGE_SIZE * (PAGES)) / (SIZE) + 31) / 32)
+
+#define SLAB(SIZE, PAGES_PER_SLAB)                                                                                     \
     struct cache_entry_##SIZE {                                                                                        \
         union {                                                                                                        \
             struct cache_entry_##SIZE *next;                                                                           \
@@ -14,10 +18,14 @@
     };                                                                                                                 \
                                                                                                                        \
     struct slab_##SIZE;                                                                                                \
+    /* Caches are naturally aligned, so the one owning an object is found by aligning its address down. */             \
     struct cache_##SIZE {                                                                                              \
-        /*struct slab_##SIZE *slab;*/                                                                                  \
-        struct cache_##SIZE *next_cache;                                                                               \
+        struct slab_##SIZE *slab;                                                                                      \
+        struct cache_##SIZE *next_cache, *prev_cache;                                                                  \
         struct cache_entry_##SIZE *first_free;                                                                         \
+        /* How many objects are handed out, and which: one bit per entry. */                                           \
+        uint32_t in_use;                                                                                               \
+        uint32_t allocated[SLAB_BITMAP_WORDS(SIZE, PAGES_PER_SLAB)];                                                   \
         struct cache_entry_##SIZE entries[];                                                                           \
     };                                                                                                                 \
                                                                                                                        \
@@ -25,49 +33,159 @@
         struct cache_##SIZE *first_empty;                                                                              \
         struct cache_##SIZE *first_partial;                                                                            \
         struct cache_##SIZE *first_full;                                                                               \
+        uint32_t max_empty; /* How many empty caches `slab_shrink_all()` leaves alone. */                              \
     };                                                                                                                 \
                                                                                                                        \
     void create_slab_##SIZE(struct slab_##SIZE *);                                                                     \
     void *slab_alloc_##SIZE(struct slab_##SIZE *);                                                                     \
     void slab_free_##SIZE(struct slab_##SIZE *, void *);                                                               \
+    size_t slab_shrink_##SIZE(struct slab_##SIZE *, uint32_t keep);                                                    \
     void slab_dbg_##SIZE(struct slab_##SIZE *);
 
-#define MAX_SLAB_SIZE 64
-#define SLAB_SIZES    X(4) X(8) X(16) X(32) X(64)
+#define MAX_SLAB_SIZE 2048
+
+// Object sizes, and how many pages each of their caches spans (must be a power of two). Past 32 bytes, there is a size
+// halfway between each power of two, so that no object wastes more than a third of its slot.
+#define SLAB_SIZES                                                                                                     \
+    X(4, 1) X(8, 1) X(16, 1) X(32, 1) X(48, 1) X(64, 1) X(96, 1) X(128, 1) X(192, 1) X(256, 1) X(384, 1) X(512, 2)     \
+        X(768, 4) X(1024, 4) X(1536, 8) X(2048, 8)
+
 
-#define X(SIZE) SLAB(SIZE)
+#define X(SIZE, PAGES) SLAB(SIZE, PAGES)
 SLAB_SIZES
 #undef X
 
 #undef SLAB
 
+// Index of each root slab in a hart's `slabs` magazines.
+enum slab_index : uint8_t {
+#define X(SIZE, PAGES) SLAB_INDEX_##SIZE,
+    SLAB_SIZES
+#undef X
+    SLAB_SIZE_COUNT
+};
+
+// Each hart keeps up to `SLAB_MAGAZINE_SIZE` free objects of every root slab, and refills/drains them
+// `SLAB_MAGAZINE_BATCH` at a time from the root slab itself, which is shared between harts under a lock.
+#define SLAB_MAGAZINE_SIZE  32
+#define SLAB_MAGAZINE_BATCH (SLAB_MAGAZINE_SIZE / 2)
+
+struct slab_magazine {
+    uint32_t count;
+    void *objects[SLAB_MAGAZINE_SIZE];
+    uint32_t hits, misses; // Allocations served from (or not from) the magazine.
+};
+
 #define _SLAB_GENERIC_CASE(f, SIZE) struct slab_##SIZE * : f##_##SIZE
 #define _SLAB_GENERIC_PARAMS(f)                                                                                        \
     _SLAB_GENERIC_CASE(f, 4), _SLAB_GENERIC_CASE(f, 8), _SLAB_GENERIC_CASE(f, 16), _SLAB_GENERIC_CASE(f, 32),          \
-        _SLAB_GENERIC_CASE(f, 64)
+        _SLAB_GENERIC_CASE(f, 48), _SLAB_GENERIC_CASE(f, 64), _SLAB_GENERIC_CASE(f, 96), _SLAB_GENERIC_CASE(f, 128),   \
+        _SLAB_GENERIC_CASE(f, 192), _SLAB_GENERIC_CASE(f, 256), _SLAB_GENERIC_CASE(f, 384),                            \
+        _SLAB_GENERIC_CASE(f, 512), _SLAB_GENERIC_CASE(f, 768), _SLAB_GENERIC_CASE(f, 1024),                           \
+        _SLAB_GENERIC_CASE(f, 1536), _SLAB_GENERIC_CASE(f, 2048)
+
 #define _SLAB_GENERIC_1(f, X)    _Generic((X), _SLAB_GENERIC_PARAMS(f))(X)
 #define _SLAB_GENERIC_2(f, X, Y) _Generic((X), _SLAB_GENERIC_PARAMS(f))(X, Y)
 
 #define create_slab(X)  _SLAB_GENERIC_1(create_slab, X)
 #define slab_alloc(X)   _SLAB_GENERIC_1(slab_alloc, X)
-#define slab_dbg(X)     _SLAB_GENERIC_1(slab_dbg, X)
+#define slab_dbg(X)     _Generic((X), _SLAB_GENERIC_PARAMS(slab_dbg), struct kmem_cache *: kmem_cache_dbg)(X)
 #define slab_free(X, Y) _SLAB_GENERIC_2(slab_free, X, Y)
+// Returns all but the first `KEEP` empty caches of a slab to the page allocator, and says how many pages that freed.
+// Root slabs that another hart is using are left alone.
+#define slab_shrink(X, KEEP) _SLAB_GENERIC_2(slab_shrink, X, KEEP)
+
+// Slabs keep this many empty caches around by default, so that an allocation right after a free doesn't have to go
+// back to the page allocator.
+#define SLAB_MAX_EMPTY 1
 
-#define X(SIZE) extern struct slab_##SIZE root_slab##SIZE;
+// A cache of objects of a single type, so that they don't share (and fragment) the root slabs with objects of other
+// sizes and lifetimes. `ctor` (if any) constructs each object once, when the block it lives in is carved up, and
+// objects must be handed back to `kmem_cache_free()` in their constructed state.
+struct kmem_cache {
+    const char *name;
+    struct kmem_cache *next; // See `kmem_caches`.
+    void (*ctor)(void *);
+    uint32_t size, align;             // Object stride (the size rounded up to `align`), and alignment.
+    uint32_t pages, capacity, offset; // Pages and objects per block, and where in a block the first object is.
+    struct kmem_block *first_empty, *first_partial, *first_full;
+    uint32_t max_empty; // How many empty blocks `slab_shrink_all()` leaves alone.
+    struct spinlock lock;
+    uint32_t allocs, frees, blocks;
+};
+
+// A naturally aligned run of pages carved into objects of one `kmem_cache`, like a `struct cache_##SIZE`. Free objects
+// are found through the bitmap rather than a free list, so that they keep their constructed state.
+struct kmem_block {
+    struct kmem_cache *cache;
+    struct kmem_block *next_block, *prev_block;
+    uint32_t in_use;
+    uint32_t free_hint;   // Every bitmap word before this one is full, so searches for a free object start here.
+    uint32_t allocated[]; // One bit per object.
+};
+
+// Every cache made by `kmem_cache_create()`.
+extern struct kmem_cache *kmem_caches;
+
+// `align` of zero means pointer alignment; pass `CACHE_LINE_SIZE` for objects that different harts write to.
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *));
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *ptr);
+// Like `slab_shrink()`, for the empty blocks of a kmem cache.
+size_t kmem_cache_shrink(struct kmem_cache *cache, uint32_t keep);
+void kmem_cache_dbg(struct kmem_cache *cache);
+
+#define X(SIZE, PAGES) extern struct slab_##SIZE root_slab##SIZE;
 SLAB_SIZES
 #undef X
 
 void init_root_slabs(void);
 
+// Hands the empty caches of every root slab and kmem cache back to the page allocator: those above each one's
+// `max_empty` watermark, or all of them when memory is short (`pressure`). Meant to be called by idle harts, and by the
+// page allocator before it gives up. Returns how many pages were freed.
+size_t slab_shrink_all(bool pressure);
+
 extern inline void *_slab_malloc(size_t);
 
+// General-purpose allocations: anything up to `MAX_SLAB_SIZE` bytes comes from the root slab of the smallest size that
+// fits, and anything larger gets whole pages of its own. Either way, `kfree()` finds out which from the page metadata.
+void *_kmalloc(size_t size);
+void *_kmalloc_large(size_t size);
+void kfree(void *ptr);
+
+// Picks the root slab at compile time, for when `SIZE` is a constant.
+#define _KMALLOC_CONST(SIZE)                                                                                           \
+    ((SIZE) <= 4      ? slab_alloc_4(&root_slab4)                                                                      \
+     : (SIZE) <= 8    ? slab_alloc_8(&root_slab8)                                                                      \
+     : (SIZE) <= 16   ? slab_alloc_16(&root_slab16)                                                                    \
+     : (SIZE) <= 32   ? slab_alloc_32(&root_slab32)                                                                    \
+     : (SIZE) <= 48   ? slab_alloc_48(&root_slab48)                                                                    \
+     : (SIZE) <= 64   ? slab_alloc_64(&root_slab64)                                                                    \
+     : (SIZE) <= 96   ? slab_alloc_96(&root_slab96)                                                                    \
+     : (SIZE) <= 128  ? slab_alloc_128(&root_slab128)                                                                  \
+     : (SIZE) <= 192  ? slab_alloc_192(&root_slab192)                                                                  \
+     : (SIZE) <= 256  ? slab_alloc_256(&root_slab256)                                                                  \
+     : (SIZE) <= 384  ? slab_alloc_384(&root_slab384)                                                                  \
+     : (SIZE) <= 512  ? slab_alloc_512(&root_slab512)                                                                  \
+     : (SIZE) <= 768  ? slab_alloc_768(&root_slab768)                                                                  \
+     : (SIZE) <= 1024 ? slab_alloc_1024(&root_slab1024)                                                                \
+     : (SIZE) <= 1536 ? slab_alloc_1536(&root_slab1536)                                                                \
+     : (SIZE) <= 2048 ? slab_alloc_2048(&root_slab2048)                                                                \
+                      : _kmalloc_large(SIZE))
+
+#define kmalloc(SIZE) (__builtin_constant_p(SIZE) ? _KMALLOC_CONST(SIZE) : _kmalloc(SIZE))
+
 #define slab_malloc(T)                                                                                                 \
-    ASSERT_STMT(sizeof(T) <= MAX_SLAB_SIZE, "Type too large for available slabs.", (T *)_slab_malloc(sizeof(T)))
+    ASSERT_STMT(sizeof(T) <= MAX_SLAB_SIZE, "Type too large for available slabs.", (T *)kmalloc(sizeof(T)))
 // #define slab_malloc(T) (sizeof(struct{_Static_assert(sizeof(T) <= 32, "Type too large for available slabs.");}),
 // (T*)_slab_malloc(sizeof(T)))
 
 #ifdef TESTS
 
 void slab_test_suite(void);
+// Hammers the root slabs from every hart at once. Must be called on all `num_harts` harts; only the one passing
+// `report` prints the results.
+void slab_smp_test(bool report);
 
 #endif
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stddef.h>
+
+// A virtual memory area: a page-aligned range of a process' address space whose pages are only allocated (and filled)
+// when they are first touched.
+struct vma {
+    struct vma *next; // Sorted by address.
+    vaddr_t start, end;
+    uint32_t flags; // PTE permission bits (R/W/X) for pages in this area.
+    // Bytes backing `[data_start, data_start + data_size)`. Everything else in the area is zero-filled.
+    const uint8_t *data;
+    vaddr_t data_start;
+    size_t data_size;
+    // If not `NULL`, one entry per page of the area, shared by every process that maps it. Missing pages are faulted in
+    // once and recorded here (holding a reference of their own). Writable areas map them copy-on-write.
+    paddr_t *frames;
+};
+
+void vma_add(struct vma **head, vaddr_t start, vaddr_t end, uint32_t flags, const void *data, vaddr_t data_start,
+             size_t data_size, paddr_t *frames);
+// Extends the anonymous area ending at `start` (with the same `flags`) up to `end`, or adds a new one if there isn't
+// one.
+void vma_grow(struct vma **head, vaddr_t start, vaddr_t end, uint32_t flags);
+struct vma *vma_find(struct vma *head, vaddr_t vaddr);
+void vma_free_all(struct vma **head);
+// Appends a copy of every area in `src` to the (empty) list at `dst`.
+void vma_clone(struct vma **dst, const struct vma *src);
+
+// Allocates, fills and maps the page containing `vaddr` (or maps the area's shared copy of it). `access` is the PTE
+// permission bit the faulting access needed.
+// Returns `false` if no area covers `vaddr`, the area doesn't allow `access`, or the page is already mapped.
+bool vma_fault(struct vma *head, uint32_t *page_table, vaddr_t vaddr, uint32_t access);
@@ -2,4 +2,31 @@
 
 #include <stddef.h>
 
-void map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags);
\ No newline at end of file
+#define MEGAPAGE_SIZE (4 * 1024 * 1024)
+
+// Level-1 entries with any of R/W/X set map a whole megapage, rather than pointing at a level-0 table.
+#define IS_LEAF(pte) (((pte) & (PAGE_R | PAGE_W | PAGE_X)) != 0)
+
+void map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags);
+// Returns the level-0 PTE for `vaddr`, or `NULL` if there is no level-0 table for it (or it's within a megapage).
+uint32_t *walk_page_table(uint32_t *table1, uint32_t vaddr);
+void map_megapage(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags);
+// Maps `size` bytes, using megapages wherever both addresses are 4MiB-aligned and there's a whole megapage left.
+void map_range(uint32_t *table1, uint32_t vaddr, paddr_t paddr, size_t size, uint32_t flags);
+
+// An address-space ID, valid only for as long as the global ASID generation hasn't moved on.
+struct asid {
+    uint32_t generation; // 0 if no ASID has been assigned yet.
+    uint16_t id;
+};
+
+// Finds out how many ASID bits this hart implements, by briefly switching to `page_table` (which must identity-map
+// the running kernel).
+void init_asids(const uint32_t *page_table);
+// Returns the `satp` value that activates `page_table` under `asid`, (re)assigning the ASID if it's from an older
+// generation and flushing whatever TLB entries might be stale. Call right before writing `satp`.
+uint32_t activate_address_space(struct asid *asid, const uint32_t *page_table);
+// Drops this hart's TLB entries for a single page of `asid`, e.g. after mapping it or changing its permissions.
+void flush_page(const struct asid *asid, uint32_t vaddr);
+// Drops this hart's TLB entries for `asid`, e.g. after its mappings changed or its process exited.
+void flush_asid(const struct asid *asid);
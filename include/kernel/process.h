@@ -1,6 +1,7 @@
 #pragma once
 
 #include <common.h>
+#include <memory_mgmt.h>
 #include <process.h>
 #include <spinlock.h>
 
@@ -21,6 +22,11 @@ bool inspect_elf(paddr_t data)
     vaddr_t sp;                   // Stack pointer
     uint32_t *page_table;         // Page table
     uint8_t (*stack)[STACK_SIZE]; // Kernel stack
+    struct asid asid;             // Address-space ID
+    struct vma *vmas;             // Demand-paged areas, see `handle_page_fault`
+    struct elf_image *image;      // The ELF the process was loaded from, if any
+    vaddr_t brk;                  // End of the heap, see `process_sbrk`
+    vaddr_t heap_end;             // End of the heap's area, which never shrinks
     enum STATE : uint8_t {
         PROC_UNUSED,
         PROC_RUNNING,
@@ -59,5 +65,45 @@ typedef struct elf32_section_header {
 // void wakeup(process *);
 // void wakeup_all(void *on);
 void switch_context(uint32_t *prev_sp, uint32_t *next_sp);
+// Builds the kernel mappings that every process' page table shares. Must run after devices have been discovered.
+void init_kernel_page_table(void);
+// An ELF file loaded into memory. Processes created from it map their pages from here, so it's kept until the last of
+// them has been reaped.
+struct elf_image {
+    struct elf_image *next;
+    struct file *file;       // Where the image was loaded from, to find it again.
+    const elf32_header *elf; // A page holding the ELF header, immediately followed by the program headers.
+    uint32_t refs;
+    // File-backed pages of the loadable segments, in segment order, shared by every process running the image (see
+    // `vma`).
+    paddr_t *frames;
+    size_t frame_count;
+};
+
+// Creates the cache process control structures come from. Must be called once, before the first process is created.
+void init_processes(void);
 struct process *create_process(const void *image, size_t image_size);
-struct process *create_process_elf(const elf32_header *);
+// Returns a reference to the image of `file`, reading it in unless a running process already did. `NULL` if it can't
+// be read.
+struct elf_image *load_elf_image(struct file *file);
+// Drops a reference returned by `load_elf_image()`, freeing the image once the last one is gone.
+void put_elf_image(struct elf_image *image);
+// Creates a process running `image`, which takes over the caller's reference to it.
+struct process *create_process_elf(struct elf_image *image);
+struct trap_frame;
+// Creates a copy-on-write clone of `parent`, which is in the middle of a `SYS_FORK` syscall with `frame`. The child
+// resumes at `user_pc`, right after the parent's `ecall`.
+struct process *fork_process(struct process *parent, const struct trap_frame *frame, uint32_t user_pc);
+// Maps in the page behind a fault at `vaddr` (or copies it, if it's copy-on-write). Returns `false` if `proc` has no
+// business touching it.
+bool handle_page_fault(struct process *proc, vaddr_t vaddr, uint32_t scause);
+// Moves the end of `proc`'s heap by `increment` bytes, returning the previous end, or `-1` if that would leave
+// `[USER_HEAP_BASE, USER_HEAP_END)`. New heap pages are zero-filled on first touch. Pages given back by shrinking the
+// heap stay mapped until the process exits.
+vaddr_t process_sbrk(struct process *proc, int32_t increment);
+
+#ifdef TESTS
+
+void process_test_suite(void);
+
+#endif
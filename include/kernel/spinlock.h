@@ -3,13 +3,14 @@
 #include <stddef.h>
 
 struct spinlock {
-    unsigned int locked;
+    unsigned int locked; // How many times the holder has acquired it. Only the holder touches this.
     char *name;
-    uint32_t hart; // The cpu holding the lock.
+    uint32_t hart; // The id + 1 of the cpu holding the lock, or 0 if it's free. Claimed and cleared atomically.
 };
 
 bool holding(struct spinlock *lk);
 void acquire(struct spinlock *);
+bool try_acquire(struct spinlock *);
 void release(struct spinlock *);
 
 void push_off(void);
@@ -5,3 +5,8 @@ _Noreturn void abort(void);
 
 unsigned int atoui(const const_string str);
 unsigned long strtoul(const const_string str, int base);
+
+// Heap allocations for user programs, from size classes of up to 2KiB (or whole spans of the heap, for anything
+// larger). `malloc()` returns `NULL` once the heap can't grow any further.
+void *malloc(size_t size);
+void free(void *ptr);
@@ -5,5 +5,10 @@ extern inline void putchar(char ch);
 extern inline int getchar(void);
 int readfile(const char *filename, char *buf, int len);
 int writefile(const char *filename, const char *buf, int len);
+// Returns the child's PID in the parent, and 0 in the child.
+int fork(void);
+// Moves the end of the heap by `increment` bytes (which may be negative), returning the previous end, or `(void *)-1`
+// if the heap can't be moved there. Memory the heap has never covered before reads as zeroes.
+void *sbrk(int increment);
 
 extern void main(void);
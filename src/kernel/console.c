@@ -32,7 +32,7 @@ int getchar(void) {
         s_putchar(&stdin, ret);
     ret = -1;
     if (stdin.buffer_r < stdin.buffer_w)
-        ret = stdin.buffer[stdin.buffer_r++ % PAGE_SIZE];
+        ret = stdin.buffer[stdin.buffer_r++ % STREAM_BUFFER_SIZE];
     release(&lock);
     return ret;
 }
@@ -44,7 +44,7 @@ void s_flush(struct stream *stream) {
         // for (int i = 0; i < 10; i++)
         //     sbi_putc('!');
         while (stdout.buffer_r < stdout.buffer_w)
-            kernel_io_config.putc(stdout.buffer[stdout.buffer_r++ % PAGE_SIZE]);
+            kernel_io_config.putc(stdout.buffer[stdout.buffer_r++ % STREAM_BUFFER_SIZE]);
         release(&lock);
         return;
     }
@@ -53,16 +53,16 @@ void s_flush(struct stream *stream) {
     }
     acquire(&stream->target->lock);
     while (stream->buffer_r < stream->buffer_w)
-        s_putchar(stream->target, stream->buffer[stream->buffer_r++ % PAGE_SIZE]);
+        s_putchar(stream->target, stream->buffer[stream->buffer_r++ % STREAM_BUFFER_SIZE]);
     release(&stream->target->lock);
     s_flush(stream->target);
 }
 
 void s_putchar(struct stream *stream, char ch) {
     if (stream->buffer != NULL) {
-        stream->buffer[stream->buffer_w++ % PAGE_SIZE] = ch;
+        stream->buffer[stream->buffer_w++ % STREAM_BUFFER_SIZE] = ch;
         if (stream->direction == STREAM_OUT &&
-            (stream->buffer_w == (stream->buffer_r + PAGE_SIZE) || (stream->auto_flush && ch == '\n')))
+            (stream->buffer_w == (stream->buffer_r + STREAM_BUFFER_SIZE) || (stream->auto_flush && ch == '\n')))
             s_flush(stream);
         return;
     }
@@ -109,34 +109,39 @@ void flush(void) {
     // //     kernel_io_config.putc('X');
     // // struct hart_local *hart = get_hart_local();
     // while (stdout.buffer_r < stdout.buffer_w)
-    //     kernel_io_config.putc(stdout.buffer[stdout.buffer_r++ % PAGE_SIZE]);
+    //     kernel_io_config.putc(stdout.buffer[stdout.buffer_r++ % STREAM_BUFFER_SIZE]);
     // // hart->buffer[hart->buffer_idx] = '\0';
     // // hart->buffer_idx = 0;
     // release(&lock);
 }
 
 // _Atomic uint16_t streamno = 0;
-// static struct slab_16 streams;
+// Each hart writes to its own stream, so they get a cache line each.
+static struct kmem_cache *streams;
+
+static void construct_stream(void *object) {
+    struct stream *stream = object;
+    stream->lock = (struct spinlock){.locked = 0, .name = NULL, .hart = 0};
+    stream->buffer_r = stream->buffer_w = 0;
+}
 
 void init_streams(void) {
-    // create_slab(&streams);
+    streams = kmem_cache_create("stream", sizeof(struct stream), CACHE_LINE_SIZE, construct_stream);
 
-    stdout.buffer = (char *)alloc_pages(1);
-    stdin.buffer = (char *)alloc_pages(1);
+    stdout.buffer = kmalloc(STREAM_BUFFER_SIZE);
+    stdin.buffer = kmalloc(STREAM_BUFFER_SIZE);
 }
 
 struct stream *create_stream(enum StreamDirection dir, struct stream *target, bool buffered, bool auto_flush) {
-    struct stream *stream = slab_malloc(struct stream); //  (struct stream*)slab_alloc(&root_slab32);
+    struct stream *stream = kmem_cache_alloc(streams);
     // TODO: validate target (exists, direction, etc);
     stream->target = target;
     // stream->no = ++streamno;
     stream->direction = dir;
     stream->auto_flush = auto_flush;
-    stream->lock = (struct spinlock){.locked = 0, .name = NULL, .hart = 0};
 
     if (buffered) {
-        // TODO: buffers don't need to be 4k each...
-        stream->buffer = (char *)alloc_pages(1);
+        stream->buffer = kmalloc(STREAM_BUFFER_SIZE);
     } else {
         stream->buffer = NULL;
     }
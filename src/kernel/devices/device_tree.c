@@ -216,7 +216,7 @@ static const char *check_stringlist_contains(const char *string_list, const char
 
 struct compatible_device {
     const char *const compatible;
-    void (*const initializer)(paddr_t);
+    void (*const initializer)(paddr_t base, uint32_t irq); // `irq` is 0 if the node has no `interrupts`.
     const uint8_t priority;
 } const compatible_devices[] = {
     {.compatible = "riscv,plic0", .initializer = plic_init, .priority = 2},
@@ -231,9 +231,11 @@ struct device_node {
     struct device_node *next;
     const struct compatible_device *compatible;
     paddr_t address;
+    uint32_t irq;
 };
 
-void check_compat(const const_string node_name, const fdt_prop *prop, struct device_node **head) {
+// Adds the node to the chain (in priority order) if it's compatible with one of `compatible_devices`, and returns it.
+struct device_node *check_compat(const const_string node_name, const fdt_prop *prop, struct device_node **head) {
     const struct compatible_device *compatible = NULL;
     for (size_t i = 0; i < NUM_COMPAT_DEVICES; i++) {
         if (check_stringlist_contains((const char *)(prop + 1), compatible_devices[i].compatible,
@@ -250,6 +252,7 @@ void check_compat(const const_string node_name, const fdt_prop *prop, struct dev
         if (*c != '\0' && c != node_name.tail) {
             struct device_node *node = slab_malloc(struct device_node);
             node->compatible = compatible;
+            node->irq = 0;
             node->address = strtoul((const_string){.head = c + 1, .tail = node_name.tail}, 16);
             DT_DBG("Adding device %s (%S), priority %hhu, to chain...\n", node_name, compatible->compatible,
                    compatible->priority);
@@ -277,8 +280,10 @@ void check_compat(const const_string node_name, const fdt_prop *prop, struct dev
                 node->next = c->next;
                 c->next = node;
             }
+            return node;
         }
     }
+    return NULL;
 }
 
 #define IS(x) strncmp(name, x, sizeof x) == 0
@@ -292,6 +297,9 @@ enum FDT_TOKEN *traverse_node(struct fdt_node *parent, enum FDT_TOKEN *token, co
         parent->next = &self;
 
     uint32_t len = strnlen_s(node_name, MAX_NODE_NAME_LENGTH);
+    // `interrupts` may come before or after `compatible`.
+    struct device_node *device = NULL;
+    uint32_t irq = 0;
 
     token += 1 + (len + sizeof(token)) / sizeof(token);
     do {
@@ -302,6 +310,8 @@ enum FDT_TOKEN *traverse_node(struct fdt_node *parent, enum FDT_TOKEN *token, co
             break;
 
         case FDT_END_NODE:
+            if (device != NULL)
+                device->irq = irq;
             token++;
             cont = false;
             break;
@@ -328,7 +338,10 @@ enum FDT_TOKEN *traverse_node(struct fdt_node *parent, enum FDT_TOKEN *token, co
                 uint32_t value = be_to_le(*(uint32_t *)(prop + 1));
                 self.size_cells = value;
             } else if (IS("compatible")) {
-                check_compat((const const_string){.head = node_name, .tail = node_name + len}, prop, head);
+                device = check_compat((const const_string){.head = node_name, .tail = node_name + len}, prop, head);
+            } else if (IS("interrupts")) {
+                // The first interrupt specifier; the PLIC's are a single cell.
+                irq = be_to_le(*(uint32_t *)(prop + 1));
             }
 
             uint32_t next_addr = ((uint32_t)(prop + 1)) + be_to_le(prop->len);
@@ -355,6 +368,118 @@ enum FDT_TOKEN *traverse_node(struct fdt_node *parent, enum FDT_TOKEN *token, co
 }
 #undef IS
 
+// Highest page-aligned physical address we can represent.
+#define MAX_PADDR 0xfffff000
+
+static uint64_t read_cells(const uint32_t *cells, uint32_t count) {
+    uint64_t value = 0;
+    for (uint32_t i = 0; i < count; i++)
+        value = (value << 32) | be_to_le(cells[i]);
+    return value;
+}
+
+static void add_memory_range(struct memory_range *ranges, size_t *count, uint64_t start, uint64_t size) {
+    // Anything above 4GiB is out of reach anyway.
+    if (size == 0 || start >= MAX_PADDR)
+        return;
+    uint64_t end = start + size;
+    if (end > MAX_PADDR)
+        end = MAX_PADDR;
+    if (*count == MEMORY_MAP_MAX_RANGES)
+        PANIC("Too many memory ranges in the device tree (max %d)!\n", MEMORY_MAP_MAX_RANGES);
+    ranges[(*count)++] = (struct memory_range){.start = start, .end = end};
+}
+
+// Collects the `reg`s of `/memory` nodes and `/reserved-memory` children. This runs before there is an allocator, so
+// it must not allocate.
+#define IS(x) strncmp(name, x, sizeof x) == 0
+static enum FDT_TOKEN *scan_memory_node(const struct fdt_node *parent, enum FDT_TOKEN *token, const char *strings,
+                                        struct memory_map *map, size_t depth, bool reserved) {
+    const char *node_name = (char *)((uint32_t)token + 4);
+    // `#address-cells` and `#size-cells` describe the `reg`s of a node's children, not its own.
+    struct fdt_node self = {node_name, NULL, 2, 1};
+    const uint32_t address_cells = parent ? parent->address_cells : 2, size_cells = parent ? parent->size_cells : 1;
+    const bool is_memory =
+        depth == 1 && (strncmp(node_name, "memory", 7) == 0 || strncmp(node_name, "memory@", 7) == 0);
+    const bool is_reserved_memory = depth == 1 && strncmp(node_name, "reserved-memory", 16) == 0;
+    bool disabled = false;
+    const fdt_prop *reg = NULL;
+
+    uint32_t len = strnlen_s(node_name, MAX_NODE_NAME_LENGTH);
+    token += 1 + (len + sizeof(token)) / sizeof(token);
+    bool cont = true;
+    do {
+        switch (be_to_le(*token)) {
+        case FDT_BEGIN_NODE:
+            token = scan_memory_node(&self, token, strings, map, depth + 1, is_reserved_memory);
+            break;
+
+        case FDT_END_NODE:
+        case FDT_END:
+            token++;
+            cont = false;
+            break;
+
+        case FDT_PROP: {
+            const fdt_prop *prop = (fdt_prop *)((uint32_t)token + 4);
+            const char *name = strings + be_to_le(prop->nameoff);
+            if (IS("#address-cells"))
+                self.address_cells = be_to_le(*(uint32_t *)(prop + 1));
+            else if (IS("#size-cells"))
+                self.size_cells = be_to_le(*(uint32_t *)(prop + 1));
+            else if (IS("reg"))
+                reg = prop;
+            else if (IS("status"))
+                disabled = strncmp((const char *)(prop + 1), "disabled", 9) == 0;
+
+            uint32_t next_addr = ((uint32_t)(prop + 1)) + be_to_le(prop->len);
+            if (next_addr % 4)
+                next_addr += 4 - (next_addr % 4);
+            token = (enum FDT_TOKEN *)(next_addr);
+        } break;
+
+        case FDT_NOP:
+            token++;
+            break;
+
+        default:
+            PANIC("Token at %p is unknown (0x%x)!\n", token, be_to_le(*token));
+            break;
+        }
+    } while (cont);
+
+    if (reg != NULL && !disabled && (is_memory || reserved)) {
+        const uint32_t *cells = (const uint32_t *)(reg + 1);
+        const size_t tuples = be_to_le(reg->len) / ((address_cells + size_cells) * sizeof(uint32_t));
+        for (size_t i = 0; i < tuples; i++, cells += address_cells + size_cells) {
+            const uint64_t start = read_cells(cells, address_cells),
+                           size = read_cells(cells + address_cells, size_cells);
+            if (is_memory)
+                add_memory_range(map->ram, &map->ram_count, start, size);
+            else
+                add_memory_range(map->reserved, &map->reserved_count, start, size);
+        }
+    }
+    return token;
+}
+#undef IS
+
+void device_tree_memory_map(const fdt_header *fdt, struct memory_map *map) {
+    if (fdt->magic != 0xedfe0dd0)
+        PANIC("Could not find FDT magic at %p!\n", fdt);
+    *map = (struct memory_map){};
+
+    // The blob itself must survive until `device_tree_init()`, and `bootargs` points into it for good.
+    add_memory_range(map->reserved, &map->reserved_count, (paddr_t)fdt, be_to_le(fdt->totalsize));
+    const fdt_reserve_entry *entries = (void *)((uint32_t)fdt + be_to_le(fdt->off_mem_rsvmap));
+    for (; entries->address != 0 || entries->size != 0; entries++)
+        add_memory_range(map->reserved, &map->reserved_count, read_cells((const uint32_t *)&entries->address, 2),
+                         read_cells((const uint32_t *)&entries->size, 2));
+
+    const char *strings = (char *)((uint32_t)fdt + be_to_le(fdt->off_dt_strings));
+    scan_memory_node(NULL, (enum FDT_TOKEN *)((uint32_t)fdt + be_to_le(fdt->off_dt_struct)), strings, map, 0, false);
+}
+
 void device_tree_init(const fdt_header *fdt) {
     if (fdt->magic != 0xedfe0dd0)
         PANIC("Could not find FDT magic at %p!\n", fdt);
@@ -369,7 +494,7 @@ void device_tree_init(const fdt_header *fdt) {
         struct device_node *c = head;
         do {
             DT_DBG("Found compatible device `%S` at %p\n", c->compatible->compatible, c->address);
-            c->compatible->initializer(c->address);
+            c->compatible->initializer(c->address, c->irq);
             struct device_node *next = c->next;
             slab_free(&root_slab16, c);
             c = next;
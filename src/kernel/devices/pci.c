@@ -12,6 +12,7 @@ struct pci_driver drivers[] = {
 };
 
 struct pci_ll *pci_ll_head = NULL, *bridges[256] = {};
+static struct kmem_cache *pci_ll_cache = NULL;
 
 void print_pci_bar(struct pci_type0_header *type0, int num) {
     struct bar *bar = &type0->bars[num];
@@ -95,7 +96,7 @@ bool probe_pci_device(paddr_t base, uint8_t bus, uint8_t slot, uint8_t func, uin
     // putchar('\n');
 
     if (device_header->class_code == 0x06) {
-        struct pci_ll *bridge = slab_malloc(struct pci_ll); // (struct pci_ll *)slab_alloc(&root_slab16);
+        struct pci_ll *bridge = kmem_cache_alloc(pci_ll_cache);
         bridge->first_child = NULL;
         bridge->next = NULL;
         // bridge->prev = pci_ll_tail;
@@ -107,7 +108,7 @@ bool probe_pci_device(paddr_t base, uint8_t bus, uint8_t slot, uint8_t func, uin
         if (slot == 0)
             bridges[bus] = bridge;
     } else {
-        struct pci_ll *device = slab_malloc(struct pci_ll); // (struct pci_ll *)slab_alloc(&root_slab16);
+        struct pci_ll *device = kmem_cache_alloc(pci_ll_cache);
         device->next = NULL;
         struct pci_ll *bridge = bridges[bus];
         if (bridge->first_child == NULL)
@@ -123,7 +124,9 @@ bool probe_pci_device(paddr_t base, uint8_t bus, uint8_t slot, uint8_t func, uin
     return true;
 }
 
-void probe_pci(paddr_t base) {
+void init_pci(void) { pci_ll_cache = kmem_cache_create("pci_ll", sizeof(struct pci_ll), 0, NULL); }
+
+void probe_pci(paddr_t base, uint32_t) {
     kprintf("Beginning PCI enumeration at %p...\n", base);
     for (uint16_t bus = 0; bus < 256; bus++)
         for (uint16_t slot = 0; slot < 256; slot++)
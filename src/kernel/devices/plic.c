@@ -11,7 +11,12 @@ paddr_t plic_base = 0;
 #define PLIC_SPRIORITY(hart) (plic_base + 0x201000 + (hart) * 0x2000)
 #define PLIC_SCLAIM(hart)    (plic_base + 0x201004 + (hart) * 0x2000)
 
-void plic_init(paddr_t base) {
+static struct {
+    void (*handler)(void *);
+    void *data;
+} irq_handlers[PLIC_MAX_IRQS];
+
+void plic_init(paddr_t base, uint32_t) {
     if (base == 0) {
         kprintf(ANSI_RED "Could not find PLIC to initialize.\n");
         return;
@@ -30,10 +35,20 @@ void plic_enable(int irq_num) {
         kprintf(ANSI_RED "Could not enable PLIC device %d: PLIC not initialized.\n", irq_num);
         return;
     }
-    *(uint32_t *)PLIC_SENABLE(get_hart_local()->hartid) = (1 << irq_num);
+    // One enable bit per source, so other sources' bits must be left alone.
+    volatile uint32_t *enable = (volatile uint32_t *)PLIC_SENABLE(get_hart_local()->hartid) + irq_num / 32;
+    *enable |= 1u << (irq_num % 32);
     *(uint32_t *)(plic_base + irq_num * 4) = 1;
 }
 
+void plic_register(int irq, void (*handler)(void *), void *data) {
+    if (irq <= 0 || irq >= PLIC_MAX_IRQS)
+        PANIC("Can't register a handler for IRQ %d!\n", irq);
+    irq_handlers[irq].handler = handler;
+    irq_handlers[irq].data = data;
+    plic_enable(irq);
+}
+
 void plic_interrupt() {
     uint32_t hartid = get_hart_local()->hartid;
     int irq = *(uint32_t *)PLIC_SCLAIM(hartid);
@@ -42,8 +57,10 @@ void plic_interrupt() {
         // printf("Entering uart interrupt...\n");
         uart_interrupt();
         // printf("Exited uart interrupt...\n");
+    } else if (irq > 0 && irq < PLIC_MAX_IRQS && irq_handlers[irq].handler != NULL) {
+        irq_handlers[irq].handler(irq_handlers[irq].data);
     } else if (irq) {
-        PANIC("UNEXPECTED IRQ\n");
+        PANIC("UNEXPECTED IRQ %d\n", irq);
     }
 
     if (irq) {
@@ -61,7 +61,7 @@ enum : uint16_t {
     BPS_115200 = 0x0001
 };
 
-void uart_init(paddr_t base) {
+void uart_init(paddr_t base, uint32_t) {
     if (base == 0) {
         kprintf(ANSI_RED "Could not find UART to initialize.\n");
         return;
@@ -1,11 +1,15 @@
 #include <color.h>
+#include <crc32.h>
+#include <devices/plic.h>
 #include <devices/virtio.h>
 #include <drivers/filesystems/fat.h>
 #include <drivers/filesystems/ustar.h>
+#include <harts.h>
 #include <io.h>
 #include <kernel.h>
 #include <memory/page_allocator.h>
 #include <memory/slab_allocator.h>
+#include <riscv.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,26 +19,36 @@ static inline uint32_t virtio_reg_read32(paddr_t base, unsigned offset) {
     return *((volatile uint32_t *)(base + offset));
 }
 
-static inline uint64_t virtio_reg_read64(paddr_t base, unsigned offset) {
-    return *((volatile uint64_t *)(base + offset));
-}
-
 static inline void virtio_reg_write32(paddr_t base, unsigned offset, uint32_t value) {
     *((volatile uint32_t *)(base + offset)) = value;
 }
 
+// Writes a pair of Low/High registers.
+static inline void virtio_reg_write64(paddr_t base, unsigned offset, uint64_t value) {
+    virtio_reg_write32(base, offset, (uint32_t)value);
+    virtio_reg_write32(base, offset + 4, (uint32_t)(value >> 32));
+}
+
 static inline void virtio_reg_fetch_and_or32(paddr_t base, unsigned offset, uint32_t value) {
     virtio_reg_write32(base, offset, virtio_reg_read32(base, offset) | value);
 }
 
-void probe_virtio_device(paddr_t base) {
+paddr_t virtio_mmio_start = 0, virtio_mmio_end = 0;
+
+void probe_virtio_device(paddr_t base, uint32_t irq) {
+    // Even empty slots are part of the window, which the kernel maps in every address space.
+    if (virtio_mmio_end == 0 || base < virtio_mmio_start)
+        virtio_mmio_start = align_down(base, PAGE_SIZE);
+    if (base + PAGE_SIZE > virtio_mmio_end)
+        virtio_mmio_end = align_down(base, PAGE_SIZE) + PAGE_SIZE;
+
     if (*((volatile uint32_t *)(base + VIRTIO_REG_MAGIC)) != 0x74726976) {
         kprintf(ANSI_RED "Given address (%p) was not a virtio device!\n", base);
         return;
     }
 
     uint32_t reg_version = *((volatile uint32_t *)(base + VIRTIO_REG_VERSION));
-    if (reg_version != 0x1) {
+    if (reg_version != 0x1 && reg_version != 0x2) {
         kprintf(ANSI_RED "Virtio device version (%#010x) unsupported.\n", reg_version);
         return;
     }
@@ -44,10 +58,13 @@ void probe_virtio_device(paddr_t base) {
     switch (device_id) {
     case 0:
         return;
-    case VIRTIO_DEVICE_BLOCK:
+    case VIRTIO_DEVICE_BLOCK: {
         kprintf("Found virtio block device.\n");
-        add_block_device(SUPER(*virtio_blk_init(base)));
+        struct virtio_blk_device *blk = virtio_blk_init(base, irq);
+        if (blk != NULL)
+            add_block_device(SUPER(*blk));
         break;
+    }
     default: {
         const_string did_name;
         switch (device_id) {
@@ -124,45 +141,179 @@ void probe_virtio_device(paddr_t base) {
     }
 }
 
-struct virtio_virtq *virtq_init(paddr_t base, unsigned index) {
-    // Allocate a region for the virtqueue.
-    paddr_t virtq_paddr = alloc_pages(align_up(sizeof(struct virtio_virtq), PAGE_SIZE) / PAGE_SIZE);
-    struct virtio_virtq *vq = (struct virtio_virtq *)virtq_paddr; // slab_malloc(struct virtio_virtq);
-    vq->queue_index = index;
-    vq->used_index = (volatile uint16_t *)&vq->used.index;
+_Static_assert(VIRTQ_MAX_ENTRIES > 0 && VIRTQ_MAX_ENTRIES <= 32768 &&
+                   (VIRTQ_MAX_ENTRIES & (VIRTQ_MAX_ENTRIES - 1)) == 0,
+               "Virtqueue sizes must be powers of two up to 32768.");
 
+// Sets up queue `index`, as large as the device allows (up to `VIRTQ_MAX_ENTRIES`). Returns NULL if the device doesn't
+// have that queue.
+struct virtio_virtq *virtq_init(paddr_t base, uint32_t version, unsigned index) {
     // 1. Select the queue writing its index (first queue is 0) to QueueSel.
     virtio_reg_write32(base, VIRTIO_REG_QUEUE_SEL, index);
 
-    // 5. Notify the device about the queue size by writing the size to QueueNum.
-    virtio_reg_write32(base, VIRTIO_REG_QUEUE_NUM, VIRTQ_ENTRY_NUM);
-
-    // 6. Notify the device about the used alignment by writing its value in bytes to QueueAlign.
-    virtio_reg_write32(base, VIRTIO_REG_QUEUE_ALIGN, 0);
+    // 3. Read maximum queue size (number of elements) from QueueNumMax. If the returned value is zero (0x0) the queue
+    // is not available.
+    const uint32_t num_max = virtio_reg_read32(base, VIRTIO_REG_QUEUE_NUM_MAX);
+    if (num_max == 0) {
+        kprintf(ANSI_RED "virtio: device at %p has no queue %u.\n" ANSI_RESET, base, index);
+        return NULL;
+    }
+    // Sizes are powers of two, so ring positions can wrap along with the 16-bit indices.
+    uint16_t num = VIRTQ_MAX_ENTRIES;
+    while (num > num_max)
+        num /= 2;
+
+    // 4. Allocate and zero the queue memory, making sure the memory is physically contiguous.
+    // Each ring is followed by its event index.
+    const size_t avail_offset = sizeof(struct virtq_desc) * num;
+    const size_t used_event_offset = avail_offset + sizeof(struct virtq_avail) + sizeof(uint16_t) * num;
+    const size_t used_offset = align_up(used_event_offset + sizeof(uint16_t), PAGE_SIZE);
+    const size_t avail_event_offset = used_offset + sizeof(struct virtq_used) + sizeof(struct virtq_used_elem) * num;
+    const size_t size = avail_event_offset + sizeof(uint16_t);
+    const paddr_t virtq_paddr = alloc_pages(align_up(size, PAGE_SIZE) / PAGE_SIZE);
+
+    struct virtio_virtq *vq = kmalloc(sizeof(struct virtio_virtq));
+    vq->descs = (struct virtq_desc *)virtq_paddr;
+    vq->avail = (struct virtq_avail *)(virtq_paddr + avail_offset);
+    vq->used = (struct virtq_used *)(virtq_paddr + used_offset);
+    vq->num = num;
+    vq->queue_index = index;
+    vq->used_index = (volatile uint16_t *)&vq->used->index;
+    vq->used_event = (volatile uint16_t *)(virtq_paddr + used_event_offset);
+    vq->avail_event = (volatile uint16_t *)(virtq_paddr + avail_event_offset);
+    vq->last_used_index = 0;
+    for (uint16_t i = 0; i < num; i++)
+        vq->descs[i].next = i + 1;
+    vq->free_head = 0;
+    vq->num_free = num;
 
-    // 7. Write the physical number of the first page of the queue to the QueuePFN register.
-    virtio_reg_write32(base, VIRTIO_REG_QUEUE_PFN, virtq_paddr);
+    // 5. Notify the device about the queue size by writing the size to QueueNum.
+    virtio_reg_write32(base, VIRTIO_REG_QUEUE_NUM, num);
+
+    if (version == 1) {
+        // 6. Notify the device about the used alignment by writing its value in bytes to QueueAlign.
+        virtio_reg_write32(base, VIRTIO_REG_QUEUE_ALIGN, 0);
+
+        // 7. Write the physical number of the first page of the queue to the QueuePFN register.
+        virtio_reg_write32(base, VIRTIO_REG_QUEUE_PFN, virtq_paddr);
+    } else {
+        // 6. Write the physical addresses of the queue's Descriptor Area, Driver Area and Device Area.
+        virtio_reg_write64(base, VIRTIO_REG_QUEUE_DESC_LOW, (paddr_t)vq->descs);
+        virtio_reg_write64(base, VIRTIO_REG_QUEUE_DRIVER_LOW, (paddr_t)vq->avail);
+        virtio_reg_write64(base, VIRTIO_REG_QUEUE_DEVICE_LOW, (paddr_t)vq->used);
+
+        // 7. Write 0x1 to QueueReady.
+        virtio_reg_write32(base, VIRTIO_REG_QUEUE_READY, 1);
+    }
 
     return vq;
 }
 
 size_t virtio_read_block(const struct block_device *dev, void *restrict tgt, size_t sector, size_t count) {
     // IS_SUBCLASS(*dev, struct virtio_blk_device);
-    for (size_t i = 0; i < count; i++)
-        read_write_disk((struct virtio_blk_device *)dev, tgt + i * SECTOR_SIZE, sector + i, 0);
-    return count;
+    struct virtio_blk_device *blk = (struct virtio_blk_device *)dev;
+    if (sector >= blk->sector_count || count > blk->sector_count - sector) {
+        kprintf("virtio: tried to read %zu sectors from sector=%zu, but capacity is %d\n", count, sector,
+                blk->sector_count);
+        return 0;
+    }
+    size_t done = 0;
+    bool failed = false;
+    while (done < count && !failed) {
+        // Queue as many requests as there's room for, back-to-back, then wait for all of them.
+        int ids[VIRTQ_MAX_ENTRIES / VIRTIO_BLK_DESCS_PER_REQ];
+        size_t queued = 0, submitted = done;
+        while (submitted < count && queued < sizeof(ids) / sizeof(ids[0])) {
+            // Split at multiples of `max_sectors`, so every request but the first starts where the device prefers.
+            const size_t left = count - submitted;
+            const size_t to_boundary = blk->max_sectors - (sector + submitted) % blk->max_sectors;
+            const size_t chunk = left < to_boundary ? left : to_boundary;
+            const int id = virtio_blk_submit(blk, tgt + submitted * SECTOR_SIZE, sector + submitted, chunk, 0);
+            if (id < 0)
+                break;
+            ids[queued++] = id;
+            submitted += chunk;
+        }
+        if (queued == 0) {
+            // Someone else's requests are holding the whole queue.
+            virtio_blk_reap(blk);
+            continue;
+        }
+        for (size_t i = 0; i < queued; i++) {
+            const unsigned sectors = blk->requests[ids[i]].bytes / SECTOR_SIZE;
+            if (!virtio_blk_wait(blk, ids[i]))
+                failed = true;
+            else if (!failed)
+                done += sectors;
+        }
+    }
+    return done;
 }
 
-struct virtio_blk_device *virtio_blk_init(paddr_t base) {
-    struct virtio_blk_device *device = slab_malloc(struct virtio_blk_device);
-    device->super.read_block = virtio_read_block;
-    device->virtio.next = NULL;
-    device->virtio.base_addr = base;
-    device->virtio.device_type = VIRTIO_DEVICE_BLOCK;
+static void virtio_blk_interrupt(void *data);
+
+// The features virtio-blk understands. Without `VIRTIO_F_VERSION_1` a modern device must be rejected.
+#define VIRTIO_BLK_FEATURES                                                                                            \
+    (VIRTIO_FEATURE(VIRTIO_BLK_F_SIZE_MAX) | VIRTIO_FEATURE(VIRTIO_BLK_F_SEG_MAX) |                                   \
+     VIRTIO_FEATURE(VIRTIO_BLK_F_BLK_SIZE) | VIRTIO_FEATURE(VIRTIO_BLK_F_TOPOLOGY) |                                  \
+     VIRTIO_FEATURE(VIRTIO_RING_F_INDIRECT_DESC) | VIRTIO_FEATURE(VIRTIO_F_EVENT_IDX) |                               \
+     VIRTIO_FEATURE(VIRTIO_F_VERSION_1))
+
+// Accepts whichever of the `wanted` features the device offers, and returns them. Legacy devices only have the first
+// 32 feature bits.
+static uint64_t virtio_negotiate_features(paddr_t base, uint32_t version, uint64_t wanted) {
+    const uint32_t words = version == 1 ? 1 : 2;
+    uint64_t offered = 0;
+    for (uint32_t sel = 0; sel < words; sel++) {
+        virtio_reg_write32(base, VIRTIO_REG_DEVICE_FEAT_SEL, sel);
+        offered |= (uint64_t)virtio_reg_read32(base, VIRTIO_REG_DEVICE_FEATURES) << (32 * sel);
+    }
+    const uint64_t accepted = offered & wanted;
+    for (uint32_t sel = 0; sel < words; sel++) {
+        virtio_reg_write32(base, VIRTIO_REG_DRIVER_FEAT_SEL, sel);
+        virtio_reg_write32(base, VIRTIO_REG_DRIVER_FEATURES, (uint32_t)(accepted >> (32 * sel)));
+    }
+    return accepted;
+}
 
-    char (*buffer)[16] = (char (*)[16])slab_malloc(struct { char _[16]; });
-    snprintf(*buffer, 16, "virtio@%08x", base);
-    device->super.id = *buffer;
+static void virtio_blk_read_config(struct virtio_blk_device *device) {
+    const volatile struct virtio_blk_config *config =
+        (const volatile struct virtio_blk_config *)(device->virtio.base_addr + VIRTIO_REG_DEVICE_CONFIG);
+    const uint64_t features = device->virtio.features;
+    device->sector_count = config->capacity;
+    device->blk_size = features & VIRTIO_FEATURE(VIRTIO_BLK_F_BLK_SIZE) ? config->blk_size : SECTOR_SIZE;
+    device->seg_max = features & VIRTIO_FEATURE(VIRTIO_BLK_F_SEG_MAX) ? config->seg_max : 0;
+
+    // Each request's data is a single segment, so it can't be larger than a segment may be.
+    uint32_t max_sectors = VIRTIO_BLK_MAX_SECTORS;
+    if (features & VIRTIO_FEATURE(VIRTIO_BLK_F_SIZE_MAX) && config->size_max >= SECTOR_SIZE &&
+        config->size_max / SECTOR_SIZE < max_sectors)
+        max_sectors = config->size_max / SECTOR_SIZE;
+    // Round down to the device's optimal I/O size (or failing that its physical block size), both counted in
+    // logical blocks.
+    if (features & VIRTIO_FEATURE(VIRTIO_BLK_F_TOPOLOGY) && device->blk_size >= SECTOR_SIZE) {
+        const uint32_t block_sectors = device->blk_size / SECTOR_SIZE;
+        uint32_t io_sectors = config->topology.opt_io_size * block_sectors;
+        if (io_sectors == 0)
+            io_sectors = block_sectors << config->topology.physical_block_exp;
+        if (io_sectors != 0 && io_sectors <= max_sectors)
+            max_sectors = max_sectors / io_sectors * io_sectors;
+    }
+    device->max_sectors = max_sectors;
+
+    // A chain can't be longer than the queue, even when most of it is in an indirect table.
+    const uint32_t num = device->virtio.queue->num;
+    uint32_t max_segments = 0;
+    if (features & VIRTIO_FEATURE(VIRTIO_RING_F_INDIRECT_DESC)) {
+        max_segments = VIRTIO_BLK_MAX_SEGMENTS < num - 2 ? VIRTIO_BLK_MAX_SEGMENTS : num - 2;
+        if (device->seg_max != 0 && device->seg_max < max_segments)
+            max_segments = device->seg_max;
+    }
+    device->max_segments = max_segments;
+}
+
+struct virtio_blk_device *virtio_blk_init(paddr_t base, uint32_t irq) {
+    const uint32_t version = virtio_reg_read32(base, VIRTIO_REG_VERSION);
 
     // 1. Reset the device.
     virtio_reg_write32(base, VIRTIO_REG_DEVICE_STATUS, 0);
@@ -170,83 +321,491 @@ struct virtio_blk_device *virtio_blk_init(paddr_t base) {
     virtio_reg_fetch_and_or32(base, VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_ACK);
     // 3. Set the DRIVER status bit.
     virtio_reg_fetch_and_or32(base, VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_DRIVER);
+    // 4. Read device feature bits, and write the subset of feature bits understood by the OS and driver to the device.
+    const uint64_t features = virtio_negotiate_features(base, version, VIRTIO_BLK_FEATURES);
     // 5. Set the FEATURES_OK status bit.
     virtio_reg_fetch_and_or32(base, VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_FEAT_OK);
+    // 6. Re-read device status to ensure the FEATURES_OK bit is still set: otherwise, the device does not support our
+    // subset of features and the device is unusable. Legacy devices have no such step.
+    if (version != 1 && ((features & VIRTIO_FEATURE(VIRTIO_F_VERSION_1)) == 0 ||
+                         (virtio_reg_read32(base, VIRTIO_REG_DEVICE_STATUS) & VIRTIO_STATUS_FEAT_OK) == 0)) {
+        kprintf(ANSI_RED "virtio-blk: device at %p did not accept features %#llx.\n" ANSI_RESET, base, features);
+        virtio_reg_fetch_and_or32(base, VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_FAILED);
+        return NULL;
+    }
 
     // 7. Perform device-specific setup, including discovery of virtqueues for the device
-    device->virtio.queue = virtq_init(base, 0);
+    struct virtio_virtq *queue = virtq_init(base, version, 0);
+    if (queue == NULL || queue->num < VIRTIO_BLK_DESCS_PER_REQ) {
+        virtio_reg_fetch_and_or32(base, VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_FAILED);
+        return NULL;
+    }
 
-    // 8. Set the DRIVER_OK status bit.
-    virtio_reg_write32(base, VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_DRIVER_OK);
+    struct virtio_blk_device *device = slab_malloc(struct virtio_blk_device);
+    device->super.read_block = virtio_read_block;
+    device->super.read_blocks = virtio_read_blocks;
+    device->virtio.next = NULL;
+    device->virtio.base_addr = base;
+    device->virtio.device_type = VIRTIO_DEVICE_BLOCK;
+    device->virtio.version = version;
+    device->virtio.features = features;
+    device->virtio.queue = queue;
 
-    // Get the disk capacity.
-    device->sector_count = virtio_reg_read64(base, VIRTIO_REG_DEVICE_CONFIG + 0);
-    kprintf("virtio-blk: capacity is %d bytes\n", device->sector_count * SECTOR_SIZE);
+    char (*buffer)[16] = (char (*)[16])slab_malloc(struct { char _[16]; });
+    snprintf(*buffer, 16, "virtio@%08x", base);
+    device->super.id = *buffer;
 
-    // Allocate a region to store requests to the device.
-    device->requests =
-        (struct virtio_blk_req *)alloc_pages(align_up(sizeof(struct virtio_blk_req), PAGE_SIZE) / PAGE_SIZE);
+    // 8. Set the DRIVER_OK status bit.
+    virtio_reg_fetch_and_or32(base, VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_DRIVER_OK);
+
+    // Get the disk capacity and geometry. Modern devices count changes to their configuration, so read it again if it
+    // changed while we were reading.
+    uint32_t generation;
+    do {
+        generation = version == 1 ? 0 : virtio_reg_read32(base, VIRTIO_REG_CONFIG_GENERATION);
+        virtio_blk_read_config(device);
+    } while (version != 1 && generation != virtio_reg_read32(base, VIRTIO_REG_CONFIG_GENERATION));
+    kprintf("virtio-blk: capacity is %d bytes, version %d, features %#llx, %d-byte blocks, up to %d sectors per "
+            "request, %d queue entries\n",
+            device->sector_count * SECTOR_SIZE, version, features, device->blk_size, device->max_sectors, queue->num);
+
+    // One request slot per descriptor that could head a chain.
+    const size_t requests_size = sizeof(struct virtio_blk_req) * device->virtio.queue->num;
+    device->requests = kmalloc(requests_size);
+    memset(device->requests, 0, requests_size);
+    device->lock = (struct spinlock){.name = "virtio-blk", .locked = 0, .hart = 0};
+    device->direct_bytes = device->bounced_bytes = 0;
+
+    // Without an interrupt (or a PLIC to deliver it), requests are completed by polling the used ring instead.
+    device->irq = plic_base != 0 ? irq : 0;
+    device->irq_hart = get_hart_local()->hartid;
+    if (device->irq != 0)
+        plic_register(device->irq, virtio_blk_interrupt, device);
 
     return device;
 }
 
+// Makes the request headed by descriptor `desc_index` available to the device, without notifying it.
+static void virtq_push(struct virtio_virtq *vq, uint16_t desc_index) {
+    vq->avail->ring[vq->avail->index % vq->num] = desc_index;
+    __sync_synchronize();
+    vq->avail->index++;
+}
+
+// Notifies the device of the requests made available since the available ring's index was `old_index`, unless it asked
+// not to be.
+static void virtq_notify(struct virtio_device *dev, uint16_t old_index) {
+    struct virtio_virtq *vq = dev->queue;
+    const uint16_t new_index = vq->avail->index;
+    __sync_synchronize();
+
+    bool notify;
+    if (dev->features & VIRTIO_FEATURE(VIRTIO_F_EVENT_IDX)) {
+        // Only if we just made available the entry the device is waiting for. Otherwise it's still working through the
+        // ring, and will get to these on its own.
+        const uint16_t event = *vq->avail_event;
+        notify = (uint16_t)(new_index - event - 1) < (uint16_t)(new_index - old_index);
+    } else {
+        notify = (*(volatile uint16_t *)&vq->used->flags & VIRTQ_USED_F_NO_NOTIFY) == 0;
+    }
+    if (notify)
+        virtio_reg_write32(dev->base_addr, VIRTIO_REG_QUEUE_NOTIFY, vq->queue_index);
+}
+
 // Notifies the device that there is a new request. `desc_index` is the index
 // of the head descriptor of the new request.
-void virtq_kick(paddr_t base, struct virtio_virtq *vq, int desc_index) {
-    vq->avail.ring[vq->avail.index % VIRTQ_ENTRY_NUM] = desc_index;
-    vq->avail.index++;
-    __sync_synchronize();
-    virtio_reg_write32(base, VIRTIO_REG_QUEUE_NOTIFY, vq->queue_index);
-    vq->last_used_index++;
+void virtq_kick(struct virtio_device *dev, int desc_index) {
+    const uint16_t old_index = dev->queue->avail->index;
+    virtq_push(dev->queue, desc_index);
+    virtq_notify(dev, old_index);
 }
 
-// Returns whether there are requests being processed by the device.
-static inline bool virtq_is_busy(struct virtio_virtq *vq) { return vq->last_used_index != *vq->used_index; }
+static inline uint16_t virtq_alloc_desc(struct virtio_virtq *vq) {
+    const uint16_t index = vq->free_head;
+    vq->free_head = vq->descs[index].next;
+    vq->num_free--;
+    return index;
+}
 
-// Reads/writes from/to virtio-blk device.
-void read_write_disk(struct virtio_blk_device *dev, void *buf, unsigned sector, int is_write) {
-    if (sector >= dev->sector_count) {
-        kprintf("virtio: tried to read/write sector=%d, but capacity is %d\n", sector, dev->sector_count);
-        return;
+// Returns every descriptor of the chain starting at `head` to the free list.
+static void virtq_free_chain(struct virtio_virtq *vq, uint16_t head) {
+    while (true) {
+        const uint16_t flags = vq->descs[head].flags, next = vq->descs[head].next;
+        vq->descs[head].next = vq->free_head;
+        vq->free_head = head;
+        vq->num_free++;
+        if ((flags & VIRTQ_DESC_F_NEXT) == 0)
+            return;
+        head = next;
     }
+}
 
-    // Construct the request according to the virtio-blk specification.
+static bool virtio_blk_in_range(struct virtio_blk_device *dev, unsigned sector, unsigned count) {
+    if (count == 0 || count > dev->max_sectors || sector >= dev->sector_count ||
+        count > dev->sector_count - sector) {
+        kprintf("virtio: tried to read/write %u sectors from sector=%d, but capacity is %d\n", count, sector,
+                dev->sector_count);
+        return false;
+    }
+    return true;
+}
+
+// The kernel maps RAM at its physical addresses, so the device can usually use the caller's buffer directly.
+static inline bool virtio_blk_can_dma(const void *buf, size_t bytes) {
+    const paddr_t paddr = (paddr_t)buf;
+    return paddr >= ram_start && paddr + bytes <= ram_end && is_aligned(paddr, VIRTIO_BLK_DMA_ALIGN);
+}
 
-    dev->requests->sector = sector;
-    dev->requests->type = is_write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
-    if (is_write)
-        memcpy_s(dev->requests->data, sizeof dev->requests->data, buf, SECTOR_SIZE);
+int virtio_blk_submit(struct virtio_blk_device *dev, void *buf, unsigned sector, unsigned count, int is_write) {
+    if (!virtio_blk_in_range(dev, sector, count))
+        return -1;
 
-    // Construct the virtqueue descriptors (using 3 descriptors).
+    acquire(&dev->lock);
     struct virtio_virtq *vq = dev->virtio.queue;
-    vq->descs[0].addr = (paddr_t)dev->requests;
-    vq->descs[0].len = sizeof(uint32_t) * 2 + sizeof(uint64_t);
-    vq->descs[0].flags = VIRTQ_DESC_F_NEXT;
-    vq->descs[0].next = 1;
+    if (vq->num_free < VIRTIO_BLK_DESCS_PER_REQ) {
+        release(&dev->lock);
+        return -1;
+    }
+    const uint16_t head = virtq_alloc_desc(vq), data = virtq_alloc_desc(vq), status = virtq_alloc_desc(vq);
+
+    // Construct the request according to the virtio-blk specification.
+    struct virtio_blk_req *req = &dev->requests[head];
+    req->header = (struct virtio_blk_req_header){.type = is_write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
+                                                 .sector = sector};
+    req->status = 0xff;
+    req->is_write = is_write;
+    req->done = false;
+    req->buf = buf;
+    req->bytes = count * SECTOR_SIZE;
+    if (virtio_blk_can_dma(buf, req->bytes)) {
+        req->data = buf;
+        dev->direct_bytes += req->bytes;
+    } else {
+        req->bounce = (uint8_t *)alloc_pages(align_up(req->bytes, PAGE_SIZE) / PAGE_SIZE);
+        req->data = req->bounce;
+        dev->bounced_bytes += req->bytes;
+        if (is_write)
+            memcpy_s(req->bounce, req->bytes, buf, req->bytes);
+    }
 
-    vq->descs[1].addr = (paddr_t)dev->requests + offsetof(struct virtio_blk_req, data);
-    vq->descs[1].len = SECTOR_SIZE;
-    vq->descs[1].flags = VIRTQ_DESC_F_NEXT | (is_write ? 0 : VIRTQ_DESC_F_WRITE);
-    vq->descs[1].next = 2;
+    // Construct the virtqueue descriptors, with the data descriptor covering the whole range.
+    vq->descs[head].addr = (paddr_t)&req->header;
+    vq->descs[head].len = sizeof(struct virtio_blk_req_header);
+    vq->descs[head].flags = VIRTQ_DESC_F_NEXT;
+    vq->descs[head].next = data;
 
-    vq->descs[2].addr = (paddr_t)dev->requests + offsetof(struct virtio_blk_req, status);
-    vq->descs[2].len = sizeof(uint8_t);
-    vq->descs[2].flags = VIRTQ_DESC_F_WRITE;
+    vq->descs[data].addr = (paddr_t)req->data;
+    vq->descs[data].len = req->bytes;
+    vq->descs[data].flags = VIRTQ_DESC_F_NEXT | (is_write ? 0 : VIRTQ_DESC_F_WRITE);
+    vq->descs[data].next = status;
+
+    vq->descs[status].addr = (paddr_t)&req->status;
+    vq->descs[status].len = sizeof(uint8_t);
+    vq->descs[status].flags = VIRTQ_DESC_F_WRITE;
 
     // Notify the device that there is a new request.
-    virtq_kick(dev->virtio.base_addr, vq, 0);
+    virtq_kick(&dev->virtio, head);
+    release(&dev->lock);
+    return head;
+}
+
+// Must hold `dev->lock`.
+static void virtio_blk_reap_locked(struct virtio_blk_device *dev) {
+    struct virtio_virtq *vq = dev->virtio.queue;
+    const bool event_idx = dev->virtio.features & VIRTIO_FEATURE(VIRTIO_F_EVENT_IDX);
+    do {
+        while (vq->last_used_index != *vq->used_index) {
+            __sync_synchronize();
+            const uint16_t head = vq->used->ring[vq->last_used_index % vq->num].id;
+            vq->last_used_index++;
+
+            struct virtio_blk_req *req = &dev->requests[head];
+            // For bounced read operations, copy the data into the buffer.
+            if (!req->is_write && req->status == 0 && req->data != req->buf)
+                memcpy_s(req->buf, req->bytes, req->data, req->bytes);
+            req->done = true;
+        }
+        if (!event_idx)
+            break;
+        // Ask to be interrupted when the next request completes, then check it didn't already.
+        *vq->used_event = vq->last_used_index;
+        __sync_synchronize();
+    } while (vq->last_used_index != *vq->used_index);
+}
+
+void virtio_blk_reap(struct virtio_blk_device *dev) {
+    acquire(&dev->lock);
+    virtio_blk_reap_locked(dev);
+    release(&dev->lock);
+}
+
+static void virtio_blk_interrupt(void *data) {
+    struct virtio_blk_device *dev = data;
+    const paddr_t base = dev->virtio.base_addr;
+    // Acknowledge first, so a completion that lands while we're reaping raises the interrupt again.
+    virtio_reg_write32(base, VIRTIO_REG_INTERRUPT_ACK, virtio_reg_read32(base, VIRTIO_REG_INTERRUPT_STATUS));
+    virtio_blk_reap(dev);
+}
+
+bool virtio_blk_wait(struct virtio_blk_device *dev, int id) {
+    struct virtio_blk_req *req = &dev->requests[id];
+    // Wait until the device finishes processing. Whoever gets to a finished request first completes it.
+    while (!req->done) {
+        // Syscalls run with interrupts off, so a process reaps for itself, and lets the others run in the meantime.
+        if (get_current_proc() != NULL) {
+            virtio_blk_reap(dev);
+            if (req->done)
+                break;
+            yield();
+        }
+        if (dev->irq == 0 || !intr_get() || get_hart_local()->hartid != dev->irq_hart) {
+            // Nothing will interrupt this hart when it's done (e.g. we're in a trap handler), so poll.
+            virtio_blk_reap(dev);
+            continue;
+        }
+        // With nothing else to do, sleep until an interrupt. Interrupts stay off between checking `done` and `wfi` so
+        // the completion can't slip in between; a pending interrupt still ends `wfi`.
+        intr_off();
+        if (!req->done)
+            WAIT_FOR_INTERRUPT();
+        intr_on();
+    }
 
-    // Wait until the device finishes processing.
-    while (virtq_is_busy(vq))
-        ;
+    // The slot (and its descriptors) can only be reused once we're done looking at it.
+    acquire(&dev->lock);
+    const uint8_t status = req->status;
+    const uint32_t sector = req->header.sector, sectors = req->bytes / SECTOR_SIZE;
+    uint8_t *bounce = req->bounce;
+    struct virtq_desc *indirect = req->indirect;
+    req->bounce = NULL;
+    req->indirect = NULL;
+    virtq_free_chain(dev->virtio.queue, id);
+    release(&dev->lock);
+    // Only requests in flight hold on to pages of their own.
+    if (bounce != NULL)
+        free_pages((paddr_t)bounce, align_up(sectors * SECTOR_SIZE, PAGE_SIZE) / PAGE_SIZE);
+    if (indirect != NULL)
+        free_pages((paddr_t)indirect, 1);
 
     // virtio-blk: If a non-zero value is returned, it's an error.
-    if (dev->requests->status != 0) {
-        kprintf("virtio: warn: failed to read/write sector=%d status=%d\n", sector, dev->requests->status);
-        return;
+    if (status != 0) {
+        kprintf("virtio: warn: failed to read/write %u sectors from sector=%d status=%d\n", sectors, sector, status);
+        return false;
+    }
+    return true;
+}
+
+// Reads/writes from/to virtio-blk device.
+bool read_write_disk(struct virtio_blk_device *dev, void *buf, unsigned sector, unsigned count, int is_write) {
+    if (!virtio_blk_in_range(dev, sector, count))
+        return false;
+    int id;
+    // Other requests hold the queue until their submitters have waited for them.
+    while ((id = virtio_blk_submit(dev, buf, sector, count, is_write)) < 0)
+        virtio_blk_reap(dev);
+    return virtio_blk_wait(dev, id);
+}
+
+// How far through a list of runs `virtio_read_blocks()` has queued.
+struct virtio_blk_cursor {
+    size_t run;    // The next run to queue.
+    size_t blocks; // How much of it is already queued.
+};
+
+// Queues one request for the run at `cursor`, taking in the runs after it for as long as they carry on from it on disk
+// and the request's indirect descriptor table has room, without notifying the device. Must hold `dev->lock`, the queue
+// must have a free descriptor, and the run at `cursor` must be non-empty and one the device can DMA into.
+static int virtio_blk_queue_runs_locked(struct virtio_blk_device *dev, const struct block_run *runs, size_t num_runs,
+                                        struct virtio_blk_cursor *cursor) {
+    struct virtio_virtq *vq = dev->virtio.queue;
+    const uint16_t head = virtq_alloc_desc(vq);
+    struct virtio_blk_req *req = &dev->requests[head];
+    req->indirect = (struct virtq_desc *)alloc_pages(1);
+
+    size_t sector = runs[cursor->run].start_block + cursor->blocks;
+    req->header = (struct virtio_blk_req_header){.type = VIRTIO_BLK_T_IN, .sector = sector};
+    req->status = 0xff;
+    req->is_write = false;
+    req->done = false;
+    // Every segment is read straight into its run, so there's nothing to copy once it's done.
+    req->buf = req->data = (uint8_t *)runs[cursor->run].buffer + cursor->blocks * SECTOR_SIZE;
+    req->bytes = 0;
+
+    struct virtq_desc *table = req->indirect;
+    table[0] = (struct virtq_desc){.addr = (paddr_t)&req->header,
+                                   .len = sizeof(struct virtio_blk_req_header),
+                                   .flags = VIRTQ_DESC_F_NEXT,
+                                   .next = 1};
+    uint16_t count = 1;
+    while (cursor->run < num_runs && count <= dev->max_segments) {
+        const struct block_run *run = &runs[cursor->run];
+        uint8_t *buffer = (uint8_t *)run->buffer + cursor->blocks * SECTOR_SIZE;
+        const size_t left = run->num_blocks - cursor->blocks;
+        if (left == 0) {
+            cursor->run++;
+            continue;
+        }
+        if (run->start_block + cursor->blocks != sector || !virtio_blk_can_dma(buffer, left * SECTOR_SIZE))
+            break;
+        // Long runs are split into segments no larger than the device takes.
+        const size_t sectors = left < dev->max_sectors ? left : dev->max_sectors;
+        table[count] = (struct virtq_desc){.addr = (paddr_t)buffer,
+                                           .len = sectors * SECTOR_SIZE,
+                                           .flags = VIRTQ_DESC_F_NEXT | VIRTQ_DESC_F_WRITE,
+                                           .next = count + 1};
+        count++;
+        sector += sectors;
+        req->bytes += sectors * SECTOR_SIZE;
+        cursor->blocks += sectors;
+        if (cursor->blocks == run->num_blocks) {
+            cursor->run++;
+            cursor->blocks = 0;
+        }
     }
+    table[count++] =
+        (struct virtq_desc){.addr = (paddr_t)&req->status, .len = sizeof(uint8_t), .flags = VIRTQ_DESC_F_WRITE};
+
+    // The whole request takes up a single descriptor of the queue.
+    vq->descs[head] = (struct virtq_desc){
+        .addr = (paddr_t)table, .len = count * sizeof(struct virtq_desc), .flags = VIRTQ_DESC_F_INDIRECT};
+    dev->direct_bytes += req->bytes;
+    virtq_push(vq, head);
+    return head;
+}
 
-    // For read operations, copy the data into the buffer.
-    if (!is_write)
-        memcpy_s(buf, SECTOR_SIZE, dev->requests->data, SECTOR_SIZE);
+size_t virtio_read_blocks(const struct block_device *dev, const struct block_run *runs, size_t num_runs) {
+    struct virtio_blk_device *blk = (struct virtio_blk_device *)dev;
+    for (size_t i = 0; i < num_runs; i++) {
+        if (runs[i].start_block >= blk->sector_count || runs[i].num_blocks > blk->sector_count - runs[i].start_block) {
+            kprintf("virtio: tried to read %zu sectors from sector=%zu, but capacity is %d\n", runs[i].num_blocks,
+                    runs[i].start_block, blk->sector_count);
+            return 0;
+        }
+    }
+
+    // Without indirect descriptors (or for buffers the device can't reach), each run is read by itself. Empty runs
+    // are skipped throughout, so that no request goes out without data.
+    size_t done = 0;
+    for (size_t i = 0; i < num_runs; i++) {
+        if (runs[i].num_blocks == 0)
+            continue;
+        if (blk->max_segments == 0 || !virtio_blk_can_dma(runs[i].buffer, runs[i].num_blocks * SECTOR_SIZE))
+            done += virtio_read_block(dev, runs[i].buffer, runs[i].start_block, runs[i].num_blocks);
+    }
+    if (blk->max_segments == 0)
+        return done;
+
+    struct virtio_blk_cursor cursor = {.run = 0, .blocks = 0};
+    bool failed = false;
+    while (!failed) {
+        // Queue as many requests as there's room for, notify the device of all of them at once, and wait.
+        int ids[VIRTQ_MAX_ENTRIES];
+        size_t queued = 0;
+        acquire(&blk->lock);
+        struct virtio_virtq *vq = blk->virtio.queue;
+        const uint16_t old_index = vq->avail->index;
+        while (queued < VIRTQ_MAX_ENTRIES && vq->num_free > 0) {
+            while (cursor.run < num_runs && cursor.blocks == 0 &&
+                   (runs[cursor.run].num_blocks == 0 ||
+                    !virtio_blk_can_dma(runs[cursor.run].buffer, runs[cursor.run].num_blocks * SECTOR_SIZE)))
+                cursor.run++;
+            if (cursor.run == num_runs)
+                break;
+            ids[queued++] = virtio_blk_queue_runs_locked(blk, runs, num_runs, &cursor);
+        }
+        if (queued > 0)
+            virtq_notify(&blk->virtio, old_index);
+        release(&blk->lock);
+        if (queued == 0) {
+            if (cursor.run == num_runs)
+                break;
+            // Someone else's requests are holding the whole queue.
+            virtio_blk_reap(blk);
+            continue;
+        }
+        for (size_t i = 0; i < queued; i++) {
+            const unsigned sectors = blk->requests[ids[i]].bytes / SECTOR_SIZE;
+            if (!virtio_blk_wait(blk, ids[i]))
+                failed = true;
+            else if (!failed)
+                done += sectors;
+        }
+    }
+    return done;
+}
+
+// Enough for a typical user program (and a few whole-range requests).
+#define VIRTIO_BENCH_SECTORS 512
+// Sectors per run when reading scattered runs, about what a cluster or two is.
+#define VIRTIO_BENCH_RUN     8
+
+void virtio_blk_bench(struct block_device *dev) {
+    if (dev->read_block != virtio_read_block)
+        return;
+    struct virtio_blk_device *blk = (struct virtio_blk_device *)dev;
+    const size_t sectors = blk->sector_count < VIRTIO_BENCH_SECTORS ? blk->sector_count : VIRTIO_BENCH_SECTORS;
+    // One page spare, for the misaligned read.
+    const size_t pages = align_up(sectors * SECTOR_SIZE, PAGE_SIZE) / PAGE_SIZE + 1;
+    uint8_t *buffer = (uint8_t *)alloc_pages(pages);
+
+    uint32_t start = READ_CSR(time);
+    for (size_t i = 0; i < sectors; i++)
+        read_write_disk(blk, buffer + i * SECTOR_SIZE, i, 1, 0);
+    const uint32_t single_ticks = READ_CSR(time) - start;
+    const uint32_t single_crc = crc32buf((char *)buffer, sectors * SECTOR_SIZE);
+    const size_t num_runs = sectors / VIRTIO_BENCH_RUN;
+    const uint32_t runs_crc = crc32buf((char *)buffer, num_runs * VIRTIO_BENCH_RUN * SECTOR_SIZE);
+
+    // Clear what the single-sector reads left behind, so that the CRC checks what the ranged read filled in.
+    memset(buffer, 0, sectors * SECTOR_SIZE);
+    start = READ_CSR(time);
+    const size_t read = virtio_read_block(dev, buffer, 0, sectors);
+    const uint32_t ranged_ticks = READ_CSR(time) - start;
+    if (read != sectors || crc32buf((char *)buffer, sectors * SECTOR_SIZE) != single_crc)
+        PANIC("virtio: %S read different data one sector at a time than as whole ranges!\n", dev->id);
+
+    // A misaligned target has to go through the bounce buffers, costing a copy of every byte read.
+    const uint64_t bounced_before = blk->bounced_bytes;
+    memset(buffer, 0, sectors * SECTOR_SIZE + 1);
+    start = READ_CSR(time);
+    virtio_read_block(dev, buffer + 1, 0, sectors);
+    const uint32_t bounced_ticks = READ_CSR(time) - start;
+    if (crc32buf((char *)buffer + 1, sectors * SECTOR_SIZE) != single_crc)
+        PANIC("virtio: %S read different data through bounce buffers!\n", dev->id);
+
+    // The same sectors as runs in reverse order, so that no two carry on from each other on disk, read with a request
+    // and a notification each, then gathered up in indirect requests.
+    struct block_run runs[VIRTIO_BENCH_SECTORS / VIRTIO_BENCH_RUN];
+    for (size_t i = 0; i < num_runs; i++) {
+        const size_t run = num_runs - 1 - i;
+        runs[i] = (struct block_run){
+            .buffer = buffer + run * VIRTIO_BENCH_RUN * SECTOR_SIZE,
+            .start_block = run * VIRTIO_BENCH_RUN,
+            .num_blocks = VIRTIO_BENCH_RUN,
+        };
+    }
+    start = READ_CSR(time);
+    for (size_t i = 0; i < num_runs; i++)
+        read_write_disk(blk, runs[i].buffer, runs[i].start_block, runs[i].num_blocks, 0);
+    const uint32_t run_ticks = READ_CSR(time) - start;
+    memset(buffer, 0, num_runs * VIRTIO_BENCH_RUN * SECTOR_SIZE);
+    start = READ_CSR(time);
+    virtio_read_blocks(dev, runs, num_runs);
+    const uint32_t gathered_ticks = READ_CSR(time) - start;
+    if (crc32buf((char *)buffer, num_runs * VIRTIO_BENCH_RUN * SECTOR_SIZE) != runs_crc)
+        PANIC("virtio: %S read different data through indirect requests!\n", dev->id);
+
+    kprintf("virtio: %S read %zuKiB in %u ticks one sector per request, %u ticks %d sectors per request (%ux "
+            "faster).\n",
+            dev->id, sectors * SECTOR_SIZE / 1024, single_ticks, ranged_ticks, blk->max_sectors,
+            single_ticks / (ranged_ticks ? ranged_ticks : 1));
+    kprintf("virtio: %S read %zuKiB in %u ticks through bounce buffers (copying %uKiB), %u ticks straight into the "
+            "target. %uKiB transferred directly, %uKiB bounced so far.\n",
+            dev->id, sectors * SECTOR_SIZE / 1024, bounced_ticks,
+            (uint32_t)(blk->bounced_bytes - bounced_before) / 1024, ranged_ticks, (uint32_t)(blk->direct_bytes / 1024),
+            (uint32_t)(blk->bounced_bytes / 1024));
+    kprintf("virtio: %S read %zu scattered runs of %d sectors in %u ticks one request each, %u ticks gathered (up to "
+            "%u segments per request).\n",
+            dev->id, num_runs, VIRTIO_BENCH_RUN, run_ticks, gathered_ticks, blk->max_segments);
+    free_pages((paddr_t)buffer, pages);
 }
@@ -11,6 +11,8 @@
 #include <drivers/filesystems/fat.h>
 #include <string.h>
 
+static struct kmem_cache *fat_file_cache = NULL;
+
 struct __attribute__((__packed__)) fat {
     uint8_t magic[3];
     char version[8];
@@ -107,117 +109,142 @@ struct long_filename {
 #define _FAT12_TABLE_VALUE(x)        (*(unsigned short *)(data + FAT12_ENT_OFFSET(x)))
 #define FAT12_TABLE_VALUE(x)         ((x & 1) ? _FAT12_TABLE_VALUE(x) >> 4 : _FAT12_TABLE_VALUE(x) & 0xfff)
 
-size_t fat12_read_file(struct filesystem *fs, void *restrict buffer, char (*name)[MAX_FILENAME_LENGTH]) {
-    // Let's be lazy and find the `struct file` for this entry...
+// The sector(s) of the FAT last looked at while following a cluster chain.
+struct fat_table_cache {
+    uint32_t sector;
+    uint8_t data[SECTOR_SIZE * 2];
+};
+
+// Returns the cluster after `cluster` in its chain, or `FAT_NO_CLUSTER` if the FAT couldn't be read.
+typedef uint32_t (*fat_next_cluster)(struct filesystem *fs, struct fat_table_cache *cache, uint32_t cluster);
+// Past the end-of-chain markers of every FAT type, so it ends any chain.
+#define FAT_NO_CLUSTER ((uint32_t)-1)
+
+// Most runs of whole sectors gathered up before they're read, see `read_block_runs()`.
+#define FAT_MAX_RUNS 32
+
+// Whole sectors waiting to be read, one run per stretch of clusters that follow each other on disk.
+struct fat_runs {
+    struct block_run runs[FAT_MAX_RUNS];
+    size_t count;
+};
+
+// Reads every queued run. Returns `false` unless all of their sectors were read.
+static bool fat_flush_runs(struct filesystem *fs, struct fat_runs *runs) {
+    size_t wanted = 0;
+    for (size_t i = 0; i < runs->count; i++)
+        wanted += runs->runs[i].num_blocks;
+    const size_t read = runs->count > 0 ? read_block_runs(fs->device, runs->runs, runs->count) : 0;
+    runs->count = 0;
+    return read == wanted;
+}
+
+// Queues a run of sectors, reading the ones already queued if there's no room left. Returns `false` if those couldn't
+// be read.
+static bool fat_add_run(struct filesystem *fs, struct fat_runs *runs, uint8_t *buffer, size_t sector, size_t count) {
+    if (runs->count > 0) {
+        struct block_run *last = &runs->runs[runs->count - 1];
+        if (last->start_block + last->num_blocks == sector &&
+            (uint8_t *)last->buffer + last->num_blocks * SECTOR_SIZE == buffer) {
+            last->num_blocks += count;
+            return true;
+        }
+    }
+    if (runs->count == FAT_MAX_RUNS && !fat_flush_runs(fs, runs))
+        return false;
+    runs->runs[runs->count++] = (struct block_run){.buffer = buffer, .start_block = sector, .num_blocks = count};
+    return true;
+}
+
+// Let's be lazy and find the `struct file` for this entry...
+static const struct file *fat_find_file(char (*name)[MAX_FILENAME_LENGTH]) {
     const struct fs_entry *file = files_head;
     for (; file != NULL && strncmp(*file->name, *name, MAX_FILENAME_LENGTH) != 0; file = file->next)
         ;
     if (file == NULL)
         PANIC("Could not find fs_entry by that name!");
-    FAT12_DBG("Found fs_entry: `%S` == `%S`?\n", *file->name, *name);
-    const struct fat_file *fat_file = SUB(struct fat_file, *SUB(struct file, *file));
-    FAT12_DBG("File should be at cluster #%u!\n", fat_file->start_cluster);
-
-    const struct fat_filesystem *fatfs = SUB(struct fat_filesystem, *fs);
+    FAT_DBG("Found fs_entry: `%S` == `%S`?\n", *file->name, *name);
+    return SUB(struct file, *file);
+}
 
-    size_t clusters_to_read = fat_file->super.size / fatfs->bytes_per_cluster;
-    uint32_t start_cluster = fat_file->start_cluster, end_cluster = fat_file->start_cluster + 1;
+// Reads `length` bytes from `offset` into `file` by walking its cluster chain, only reading whole sectors straight into
+// `buffer` (and going through a bounce sector for partial ones at either end). The whole sectors are gathered into runs
+// and read together, so a fragmented file still costs the device few requests. Returns 0 if any of it couldn't be read.
+static size_t fat_read_file_at(struct filesystem *fs, const struct fat_file *file, uint8_t *restrict buffer,
+                               size_t offset, size_t length, fat_next_cluster next_cluster, uint32_t end_of_chain) {
+    if (offset >= file->super.size)
+        return 0;
+    if (length > file->super.size - offset)
+        length = file->super.size - offset;
 
-    uint32_t active_cluster = start_cluster;
-    uint32_t data_sector = FAT12_DISC_OFF(active_cluster) / SECTOR_SIZE;
-    uint32_t current_sector = data_sector;
-    uint8_t data[SECTOR_SIZE * 2];
-    fs->device->read_block(fs->device, data, data_sector + fs->base_sector, 2);
-
-    size_t bytes_read = 0;
-    do {
-        uint16_t tv = FAT12_TABLE_VALUE(active_cluster);
-        while (tv == active_cluster + 1) {
-            end_cluster++;
-            active_cluster++;
-            data_sector = FAT12_DISC_OFF(active_cluster) / SECTOR_SIZE;
-            if (data_sector != current_sector) {
-                current_sector = data_sector;
-                fs->device->read_block(fs->device, data, data_sector + fs->base_sector, 2);
-            }
-            tv = FAT12_TABLE_VALUE(active_cluster);
+    const struct fat_filesystem *fatfs = SUB(struct fat_filesystem, *fs);
+    struct fat_table_cache cache = {.sector = (uint32_t)-1};
+    uint32_t cluster = file->start_cluster;
+    for (size_t skip = offset / fatfs->bytes_per_cluster; skip > 0 && cluster >= 2 && cluster < end_of_chain; skip--)
+        cluster = next_cluster(fs, &cache, cluster);
+
+    uint8_t bounce[SECTOR_SIZE];
+    struct fat_runs runs = {.count = 0};
+    size_t done = 0;
+    while (true) {
+        if (cluster < 2 || cluster >= end_of_chain) {
+            kprintf(ANSI_RED "Cluster chain of `%S` is shorter than its %zu bytes, or its FAT couldn't be read!\n",
+                    *file->super.super.name, file->super.size);
+            return 0;
         }
-        FAT12_DBG("Will read these %u sequential clusters: %u-%u. That's %zu bytes!\n", end_cluster - start_cluster,
-                  start_cluster, end_cluster - 1, fatfs->bytes_per_cluster * (end_cluster - start_cluster));
-
         const uint32_t first_sector = ((fatfs->relative_first_data_sector * fatfs->bytes_per_sector) +
-                                       ((start_cluster - 2) * fatfs->bytes_per_cluster)) /
-                                      SECTOR_SIZE;
-        const uint32_t sectors_to_read =
-            (((end_cluster - start_cluster) * fatfs->bytes_per_cluster) + SECTOR_SIZE - 1) / SECTOR_SIZE;
-        FAT12_DBG("That translates to reading %u sectors (as there are %zu sectors per cluster) starting at sector "
-                  "number %u.\n",
-                  sectors_to_read, fatfs->bytes_per_sector, first_sector + fs->base_sector);
-        // const size_t read = fs->device->read_block(fs->device, buffer, first_sector + fs->base_sector,
-        // sectors_to_read) * SECTOR_SIZE; kprintf("Read %zu bytes (%zu sectors * %zu = %zu)...\n", read,
-        // sectors_to_read, SECTOR_SIZE, sectors_to_read * SECTOR_SIZE); buffer += read; bytes_read += read;
-
-        if (tv == 0xfff) {
-            FAT12_DBG("Last sector! So far we've read %zu, meaning we have %zu left... Modulo is %u...\n", bytes_read,
-                      fat_file->super.size - bytes_read, fat_file->super.size % fatfs->bytes_per_cluster);
-            // We're including the last cluster!
-            if ((end_cluster - start_cluster) > 1 && fat_file->super.size % fatfs->bytes_per_cluster) {
-                // If we're reading more than one cluster, isolate the last one
-                end_cluster--;
-                FAT12_DBG("We were going to read %u, but now we're reading one less (%u-%u)...\n",
-                          end_cluster - start_cluster + 1, start_cluster, end_cluster - 1);
-                const size_t read =
-                    fs->device->read_block(fs->device, buffer, first_sector + fs->base_sector,
-                                           ((end_cluster - start_cluster) * fatfs->bytes_per_cluster) / SECTOR_SIZE) *
-                    SECTOR_SIZE;
-                FAT12_DBG("Read %zu bytes (%zu sectors * %zu = %zu)...\n", read,
-                          ((end_cluster - start_cluster) * fatfs->bytes_per_cluster + SECTOR_SIZE - 1) / SECTOR_SIZE,
-                          SECTOR_SIZE, ((end_cluster - start_cluster) * fatfs->bytes_per_cluster));
-                buffer += read;
-                bytes_read += read;
+                                       ((cluster - 2) * fatfs->bytes_per_cluster)) /
+                                          SECTOR_SIZE +
+                                      fs->base_sector;
+        const size_t within = (offset + done) % fatfs->bytes_per_cluster;
+        const size_t left = length - done, room = fatfs->bytes_per_cluster - within;
+        const size_t end = within + (left < room ? left : room);
+        for (size_t pos = within; pos < end;) {
+            const size_t in_sector = pos % SECTOR_SIZE;
+            if (in_sector == 0 && end - pos >= SECTOR_SIZE) {
+                const size_t sectors = (end - pos) / SECTOR_SIZE;
+                if (!fat_add_run(fs, &runs, buffer + done + (pos - within), first_sector + pos / SECTOR_SIZE,
+                                 sectors))
+                    return 0;
+                pos += sectors * SECTOR_SIZE;
+                continue;
             }
-            start_cluster = end_cluster++;
-            FAT12_DBG("Now to read the final cluster (%u)...\n", start_cluster);
-            const size_t bytes_to_read = fat_file->super.size % fatfs->bytes_per_cluster;
-
-            // We're relying on a GCC extension here (dynamically sized arrays)...
-
-            char temp[align_up(bytes_to_read, SECTOR_SIZE)] = {};
-            const size_t read = fs->device->read_block(fs->device, temp,
-                                                       ((fatfs->relative_first_data_sector * fatfs->bytes_per_sector) +
-                                                        ((start_cluster - 2) * fatfs->bytes_per_cluster)) /
-                                                               SECTOR_SIZE +
-                                                           fs->base_sector,
-                                                       (bytes_to_read + SECTOR_SIZE - 1) / SECTOR_SIZE) *
-                                SECTOR_SIZE;
-            if (read < bytes_to_read) {
-                PANIC("Failed to read (%zu < %zu)???\n", read, bytes_to_read);
-            }
-            FAT12_DBG("Read %zu bytes (%zu sectors * %zu = %zu)...\n", read,
-                      (bytes_to_read + SECTOR_SIZE - 1) / SECTOR_SIZE, SECTOR_SIZE,
-                      align_up(bytes_to_read, SECTOR_SIZE));
-            memcpy_s(buffer, bytes_to_read, temp, bytes_to_read);
-            return bytes_read + bytes_to_read;
-        } else {
-            const size_t read =
-                fs->device->read_block(fs->device, buffer, first_sector + fs->base_sector, sectors_to_read) *
-                SECTOR_SIZE;
-            FAT12_DBG("Read %zu bytes (%zu sectors * %zu = %zu)...\n", read, sectors_to_read, SECTOR_SIZE,
-                      sectors_to_read * SECTOR_SIZE);
-            buffer += read;
-            bytes_read += read;
+            const size_t count = SECTOR_SIZE - in_sector < end - pos ? SECTOR_SIZE - in_sector : end - pos;
+            if (fs->device->read_block(fs->device, bounce, first_sector + pos / SECTOR_SIZE, 1) != 1)
+                return 0;
+            memcpy_s(buffer + done + (pos - within), count, bounce + in_sector, count);
+            pos += count;
         }
+        done += end - within;
+        if (done == length)
+            return fat_flush_runs(fs, &runs) ? length : 0;
 
-        FAT12_DBG(ANSI_GREEN "\tCluster[%u]=%#hx\n", active_cluster, tv);
-        clusters_to_read -= end_cluster - start_cluster;
-        end_cluster = 1 + (start_cluster = active_cluster = tv);
+        cluster = next_cluster(fs, &cache, cluster);
+    }
+}
 
-        if (tv == 0xfff && clusters_to_read) {
-            PANIC("Somehow got to the end of the file without having read enough data!! (clusters_to_read=%zu)\n",
-                  clusters_to_read);
+static uint32_t fat12_next_cluster(struct filesystem *fs, struct fat_table_cache *cache, uint32_t cluster) {
+    // Entries are a sector and a half wide, so they may straddle two sectors.
+    const uint32_t sector = FAT12_DISC_OFF(cluster) / SECTOR_SIZE;
+    if (cache->sector != sector) {
+        if (fs->device->read_block(fs->device, cache->data, sector + fs->base_sector, 2) != 2) {
+            cache->sector = (uint32_t)-1;
+            return FAT_NO_CLUSTER;
         }
-    } while (clusters_to_read);
-    PANIC("Unreachable!\n");
+        cache->sector = sector;
+    }
+    const uint8_t *data = cache->data;
+    return FAT12_TABLE_VALUE(cluster);
+}
+
+size_t fat12_read_file_at(struct filesystem *fs, const struct file *file, void *restrict buffer, size_t offset,
+                          size_t length) {
+    return fat_read_file_at(fs, SUB(struct fat_file, *file), buffer, offset, length, fat12_next_cluster, 0xff8);
+}
+
+size_t fat12_read_file(struct filesystem *fs, void *restrict buffer, char (*name)[MAX_FILENAME_LENGTH]) {
+    const struct file *file = fat_find_file(name);
+    return fat12_read_file_at(fs, file, buffer, 0, file->size);
 }
 
 static size_t fat_no = 0;
@@ -276,6 +303,7 @@ bool fat12_init(const struct block_device *dev, uint32_t base_sector, const stru
     fs->super.base_sector = base_sector;
     fs->super.device = dev;
     fs->super.read_file = fat12_read_file;
+    fs->super.read_file_at = fat12_read_file_at;
     add_filesystem(SUPER(*fs));
 
     FAT12_DBG("Each cluster is %u bytes. Data starts at %#p\n", bytes_per_cluster,
@@ -410,7 +438,7 @@ bool fat12_init(const struct block_device *dev, uint32_t base_sector, const stru
         FAT_DBG(ANSI_CYAN "\tFile should be %u clusters (last cluster is only %u bytes).\n" ANSI_RESET,
                 this_entry->file_size / bytes_per_cluster + ((this_entry->file_size % bytes_per_cluster) ? 1 : 0), rem);
 
-        struct fat_file *file = slab_malloc(struct fat_file);
+        struct fat_file *file = kmem_cache_alloc(fat_file_cache);
         file->super.super.filesystem = SUPER(*fs);
         file->start_cluster = ((uint32_t)this_entry->cluster_high << 16) | this_entry->cluster_low;
         char (*fnameBuffer)[MAX_FILENAME_LENGTH] = (char (*)[MAX_FILENAME_LENGTH])_slab_malloc(MAX_FILENAME_LENGTH);
@@ -451,114 +479,26 @@ bool fat12_init(const struct block_device *dev, uint32_t base_sector, const stru
 #define FAT16_DISC_OFF(active_cluster)          (FAT16_SECTOR(active_cluster) * SECTOR_SIZE + FAT16_ENT_OFFSET(active_cluster))
 #define FAT16_TABLE_VALUE(active_cluster, data) (*(unsigned short *)&data[FAT16_ENT_OFFSET(active_cluster)])
 
-size_t fat16_read_file(struct filesystem *fs, void *restrict buffer, char (*name)[MAX_FILENAME_LENGTH]) {
-    // Let's be lazy and find the `struct file` for this entry...
-    const struct fs_entry *file = files_head;
-    for (; file != NULL && strncmp(*file->name, *name, MAX_FILENAME_LENGTH) != 0; file = file->next)
-        ;
-    if (file == NULL)
-        PANIC("Could not find fs_entry by that name!");
-    FAT12_DBG("Found fs_entry: `%S` == `%S`?\n", *file->name, *name);
-    const struct fat_file *fat_file = SUB(struct fat_file, *SUB(struct file, *file));
-    FAT12_DBG("File should be at cluster #%u!\n", fat_file->start_cluster);
-
-    const struct fat_filesystem *fatfs = SUB(struct fat_filesystem, *fs);
-
-    size_t clusters_to_read = fat_file->super.size / fatfs->bytes_per_cluster;
-    uint32_t start_cluster = fat_file->start_cluster, end_cluster = fat_file->start_cluster + 1;
-
-    uint32_t active_cluster = start_cluster;
-    struct block data = {.block_number = FAT16_SECTOR(active_cluster) + fs->base_sector};
-    // uint32_t current_sector = data.block_number;
-    fs->device->read_block(fs->device, data.data, data.block_number, 1);
-
-    size_t bytes_read = 0;
-    do {
-        uint16_t tv = FAT16_TABLE_VALUE(active_cluster, data.data);
-        FAT16_DBG("Value of cluster %u is %hu...\n", active_cluster, tv);
-        while (tv == active_cluster + 1) {
-            end_cluster++;
-            active_cluster++;
-            const uint32_t data_sector = FAT16_SECTOR(active_cluster) + fs->base_sector;
-            if (data_sector != data.block_number) {
-                data.block_number = data_sector;
-                fs->device->read_block(fs->device, data.data, data.block_number, 1);
-            }
-            tv = FAT16_TABLE_VALUE(active_cluster, data.data);
-        }
-        FAT16_DBG("Will read these %u sequential clusters: %u-%u. That's %zu bytes!\n", end_cluster - start_cluster,
-                  start_cluster, end_cluster - 1, fatfs->bytes_per_cluster * (end_cluster - start_cluster));
-
-        const uint32_t first_sector = ((fatfs->relative_first_data_sector * fatfs->bytes_per_sector) +
-                                       ((start_cluster - 2) * fatfs->bytes_per_cluster)) /
-                                      SECTOR_SIZE;
-        const uint32_t sectors_to_read =
-            (((end_cluster - start_cluster) * fatfs->bytes_per_cluster) + SECTOR_SIZE - 1) / SECTOR_SIZE;
-        FAT16_DBG("That translates to reading %u sectors (as there are %zu sectors per cluster) starting at sector "
-                  "number %u.\n",
-                  sectors_to_read, fatfs->bytes_per_sector, first_sector + fs->base_sector);
-
-        if (tv == 0xffff) {
-            FAT16_DBG("Last sector! So far we've read %zu, meaning we have %zu left... Modulo is %u...\n", bytes_read,
-                      fat_file->super.size - bytes_read, fat_file->super.size % fatfs->bytes_per_cluster);
-            // We're including the last cluster!
-            if ((end_cluster - start_cluster) > 1 && fat_file->super.size % fatfs->bytes_per_cluster) {
-                // If we're reading more than one cluster, isolate the last one
-                end_cluster--;
-                FAT16_DBG("We were going to read %u, but now we're reading one less (%u-%u)...\n",
-                          end_cluster - start_cluster + 1, start_cluster, end_cluster - 1);
-                const size_t read =
-                    fs->device->read_block(fs->device, buffer, first_sector + fs->base_sector,
-                                           ((end_cluster - start_cluster) * fatfs->bytes_per_cluster) / SECTOR_SIZE) *
-                    SECTOR_SIZE;
-                FAT16_DBG("Read %zu bytes (%zu sectors * %zu = %zu)...\n", read,
-                          ((end_cluster - start_cluster) * fatfs->bytes_per_cluster + SECTOR_SIZE - 1) / SECTOR_SIZE,
-                          SECTOR_SIZE, ((end_cluster - start_cluster) * fatfs->bytes_per_cluster));
-                buffer += read;
-                bytes_read += read;
-            }
-            start_cluster = end_cluster++;
-            FAT16_DBG("Now to read the final cluster (%u)...\n", start_cluster);
-            const size_t bytes_to_read = fat_file->super.size % fatfs->bytes_per_cluster;
-
-            // We're relying on a GCC extension here (dynamically sized arrays)...
-
-            char temp[align_up(bytes_to_read, SECTOR_SIZE)] = {};
-            const size_t read = fs->device->read_block(fs->device, temp,
-                                                       ((fatfs->relative_first_data_sector * fatfs->bytes_per_sector) +
-                                                        ((start_cluster - 2) * fatfs->bytes_per_cluster)) /
-                                                               SECTOR_SIZE +
-                                                           fs->base_sector,
-                                                       (bytes_to_read + SECTOR_SIZE - 1) / SECTOR_SIZE) *
-                                SECTOR_SIZE;
-            if (read < bytes_to_read) {
-                PANIC("Failed to read (%zu < %zu)???\n", read, bytes_to_read);
-            }
-            FAT16_DBG("Read %zu bytes (%zu sectors * %zu = %zu)...\n", read,
-                      (bytes_to_read + SECTOR_SIZE - 1) / SECTOR_SIZE, SECTOR_SIZE,
-                      align_up(bytes_to_read, SECTOR_SIZE));
-            memcpy_s(buffer, bytes_to_read, temp, bytes_to_read);
-            return bytes_read + bytes_to_read;
-        } else {
-            const size_t read =
-                fs->device->read_block(fs->device, buffer, first_sector + fs->base_sector, sectors_to_read) *
-                SECTOR_SIZE;
-            FAT16_DBG("Read %zu bytes (%zu sectors * %zu = %zu)...\n", read, sectors_to_read, SECTOR_SIZE,
-                      sectors_to_read * SECTOR_SIZE);
-            buffer += read;
-            bytes_read += read;
+static uint32_t fat16_next_cluster(struct filesystem *fs, struct fat_table_cache *cache, uint32_t cluster) {
+    const uint32_t sector = FAT16_SECTOR(cluster);
+    if (cache->sector != sector) {
+        if (fs->device->read_block(fs->device, cache->data, sector + fs->base_sector, 1) != 1) {
+            cache->sector = (uint32_t)-1;
+            return FAT_NO_CLUSTER;
         }
+        cache->sector = sector;
+    }
+    return FAT16_TABLE_VALUE(cluster, cache->data);
+}
 
-        FAT16_DBG(ANSI_GREEN "\tCluster[%u]=%#hx\n", active_cluster, tv);
-        clusters_to_read -= end_cluster - start_cluster;
-        end_cluster = 1 + (start_cluster = active_cluster = tv);
+size_t fat16_read_file_at(struct filesystem *fs, const struct file *file, void *restrict buffer, size_t offset,
+                          size_t length) {
+    return fat_read_file_at(fs, SUB(struct fat_file, *file), buffer, offset, length, fat16_next_cluster, 0xfff8);
+}
 
-        if (tv == 0xffff && clusters_to_read) {
-            PANIC("Somehow got to the end of the file without having read enough data!! (clusters_to_read=%zu)\n",
-                  clusters_to_read);
-        }
-    } while (clusters_to_read);
-    PANIC("Unreachable!\n");
+size_t fat16_read_file(struct filesystem *fs, void *restrict buffer, char (*name)[MAX_FILENAME_LENGTH]) {
+    const struct file *file = fat_find_file(name);
+    return fat16_read_file_at(fs, file, buffer, 0, file->size);
 }
 
 bool fat16_init(const struct block_device *dev, uint32_t base_sector, const struct fat_12_16 *fat2) {
@@ -610,6 +550,7 @@ bool fat16_init(const struct block_device *dev, uint32_t base_sector, const stru
     fs->super.base_sector = base_sector;
     fs->super.device = dev;
     fs->super.read_file = fat16_read_file;
+    fs->super.read_file_at = fat16_read_file_at;
     add_filesystem(SUPER(*fs));
 
     FAT16_DBG("Each cluster is %u bytes. Data starts at %#p\n", bytes_per_cluster,
@@ -768,7 +709,7 @@ bool fat16_init(const struct block_device *dev, uint32_t base_sector, const stru
         //     ((start_cluster - 2) * bytes_per_cluster), (uint32_t)(first_data_sector * fat->bytes_per_sector) +
         //     ((start_cluster - 2) * bytes_per_cluster) + this_entry->file_size);
 
-        struct fat_file *file = slab_malloc(struct fat_file);
+        struct fat_file *file = kmem_cache_alloc(fat_file_cache);
         file->super.super.filesystem = SUPER(*fs);
         file->start_cluster = ((uint32_t)this_entry->cluster_high << 16) | this_entry->cluster_low;
         char (*fnameBuffer)[MAX_FILENAME_LENGTH] = (char (*)[MAX_FILENAME_LENGTH])_slab_malloc(MAX_FILENAME_LENGTH);
@@ -803,6 +744,8 @@ bool fat16_init(const struct block_device *dev, uint32_t base_sector, const stru
     return true;
 }
 
+void init_fat(void) { fat_file_cache = kmem_cache_create("fat_file", sizeof(struct fat_file), 0, NULL); }
+
 bool fat_init(const struct block_device *dev, struct block *base) {
     const struct fat *fat = (struct fat *)base->data;
     FAT_DBG(ANSI_GREEN "\n[FAT] Found FAT-formatted disk at sector #%u.\n"
@@ -9,6 +9,8 @@
 #include <kernel.h>
 #include <memory/slab_allocator.h>
 
+static struct kmem_cache *ustar_file_cache = NULL;
+
 static inline int oct2int(char *oct, int len) {
     int dec = 0;
     for (int i = 0; i < len; i++) {
@@ -68,11 +70,44 @@ size_t read_ustar_file(struct filesystem *fs, void *restrict buffer, char (*path
     PANIC("read_ustar_file is not implemented!\n");
 }
 
+size_t read_ustar_file_at(struct filesystem *fs, const struct file *file, void *restrict buffer, size_t offset,
+                          size_t length) {
+    if (offset >= file->size)
+        return 0;
+    if (length > file->size - offset)
+        length = file->size - offset;
+
+    const struct ustar_file *ufile = SUB(struct ustar_file, *file);
+    struct block block;
+    for (size_t done = 0; done < length;) {
+        const size_t pos = offset + done, in_block = pos % SECTOR_SIZE;
+        block.block_number = ufile->data_block + pos / SECTOR_SIZE;
+        if (in_block == 0 && length - done >= SECTOR_SIZE) {
+            // Whole blocks go straight into the buffer.
+            const size_t blocks = (length - done) / SECTOR_SIZE;
+            const size_t read = fs->device->read_block(fs->device, buffer + done, block.block_number, blocks);
+            if (read != blocks)
+                return done + read * SECTOR_SIZE;
+            done += blocks * SECTOR_SIZE;
+            continue;
+        }
+        const size_t count = SECTOR_SIZE - in_block < length - done ? SECTOR_SIZE - in_block : length - done;
+        if (fs->device->read_block(fs->device, block.data, block.block_number, 1) != 1)
+            return done;
+        memcpy_s(buffer + done, count, block.data + in_block, count);
+        done += count;
+    }
+    return length;
+}
+
+void init_ustar(void) { ustar_file_cache = kmem_cache_create("ustar_file", sizeof(struct ustar_file), 0, NULL); }
+
 bool ustar_init(struct block_device *dev, struct block *block) {
     struct ustar_filesystem *fs = slab_malloc(struct ustar_filesystem);
     fs->super.type_name = "USTAR";
     fs->super.device = dev;
     fs->super.read_file = read_ustar_file;
+    fs->super.read_file_at = read_ustar_file_at;
     add_filesystem(SUPER(*fs));
 
     static size_t ustar_number = 0;
@@ -96,7 +131,7 @@ bool ustar_init(struct block_device *dev, struct block *block) {
 
         int filesz = oct2int(header->size, sizeof(header->size));
 
-        struct ustar_file *file = slab_malloc(struct ustar_file);
+        struct ustar_file *file = kmem_cache_alloc(ustar_file_cache);
         file->super.super.filesystem = SUPER(*fs);
 
         char *buffer = _slab_malloc(MAX_FILENAME_LENGTH);
@@ -109,6 +144,7 @@ bool ustar_init(struct block_device *dev, struct block *block) {
         //           filesz, sizeof file->data);
         // memcpy_s(file->data, sizeof file->data, header->data, filesz);
         file->super.size = filesz;
+        file->data_block = start + off + 1;
         add_fs_entry(SUPER(*SUPER(*file)));
 
         off += align_up(sizeof(struct tar_header) + filesz, SECTOR_SIZE) / SECTOR_SIZE;
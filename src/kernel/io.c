@@ -181,6 +181,15 @@ void add_block_device(struct block_device *dev) {
     block_device_chain_head = dev;
 }
 
+size_t read_block_runs(const struct block_device *dev, const struct block_run *runs, size_t num_runs) {
+    if (dev->read_blocks != NULL)
+        return dev->read_blocks(dev, runs, num_runs);
+    size_t read = 0;
+    for (size_t i = 0; i < num_runs; i++)
+        read += dev->read_block(dev, runs[i].buffer, runs[i].start_block, runs[i].num_blocks);
+    return read;
+}
+
 void fs_init(struct block_device *dev) {
     if (dev->id != NULL) {
         printf("\n\n");
@@ -10,6 +10,8 @@
 #include <devices/plic.h>
 #include <devices/uart.h>
 #include <devices/virtio.h>
+#include <drivers/filesystems/fat.h>
+#include <drivers/filesystems/ustar.h>
 #include <harts.h>
 #include <kernel.h>
 #include <memory/page_allocator.h>
@@ -22,7 +24,7 @@
 #include <common.h>
 #include <crc32.h>
 
-extern char __bss[], __bss_end[], __stack_top[], __free_ram[], __free_ram_end[], __kernel_base[];
+extern char __bss[], __bss_end[], __stack_top[], __free_ram[], __kernel_base[];
 extern struct process procs[PROCS_MAX];
 
 const_string bootargs = CSTR("");
@@ -254,11 +256,7 @@ uint32_t boot_hart_id;
 __attribute__((used)) void secondary_main(uint32_t hartid) {
     WRITE_CSR(stvec, (uint32_t)kernel_entry);
     heart_locals[hartid].hartid = hartid;
-    heart_locals[hartid].stdout = create_stream(STREAM_OUT, &stdout, true, true);
-
-    WRITE_CSR(sstatus, READ_CSR(sstatus) | SSTATUS_ENABLE_SIE);
-    WRITE_CSR(sie, READ_CSR(sie) | SIE_TIMERS);
-
+    // `gp` must point at our hart-local block before anything takes a lock (e.g. `create_stream`).
     __asm__ __volatile__("mv gp, %[hartid]\n"
                          "mv tp, %[procid]"
                          :                                      // Output
@@ -266,19 +264,29 @@ __attribute__((used)) void secondary_main(uint32_t hartid) {
                            [procid] "r"(&heart_locals[hartid].current_proc)
                          : "gp", "tp" // Clobbers
     );
+    heart_locals[hartid].stdout = create_stream(STREAM_OUT, &stdout, true, true);
+
+    WRITE_CSR(scounteren, SCOUNTEREN_TM);
+    WRITE_CSR(sstatus, READ_CSR(sstatus) | SSTATUS_ENABLE_SIE);
+    WRITE_CSR(sie, READ_CSR(sie) | SIE_TIMERS);
 
     kprintf_c("[Hart #%ld] Started!\n", ANSI_CYAN, hartid);
+#ifdef TESTS
+    slab_smp_test(false);
+#endif
 
     sbiret value;
     while (!is_shutting_down) {
+        // Spend idle time returning empty slab caches, and zeroing free pages so `alloc_pages()` doesn't have to.
+        slab_shrink_all(false);
+        while (!is_shutting_down && zero_free_page())
+            ;
         uint32_t time = READ_CSR(time);
-        kprintf_c("[Hart #%ld] CPU uptime: %d ticks. (%d.%ds)\n", ANSI_CYAN, hartid, time, time / CLOCK_FREQ,
-                  (time % CLOCK_FREQ) / (CLOCK_FREQ / 1000));
         // sbi_call(future, 0, 0, 0, 0, 0, SBI_TIME_FN_SET_TIMER, SBI_EXT_TIME);
         // uint32_t sie = READ_CSR(sie);
         // printf("Disabling external interrupts (%#08x -> %#08x)\n", sie, sie&~SIE_EXTERNAL);
         WRITE_CSR(sie, READ_CSR(sie) & ~SIE_EXTERNAL);
-        WRITE_CSR(stimecmp, time + (CLOCK_FREQ * 1));
+        WRITE_CSR(stimecmp, time + (CLOCK_FREQ / 10));
         WAIT_FOR_INTERRUPT();
         // printf("Re-enabling interrupts...\n");
         WRITE_CSR(sie, READ_CSR(sie) | SIE_EXTERNAL);
@@ -290,6 +298,29 @@ __attribute__((used)) void secondary_main(uint32_t hartid) {
 }
 
 void secondary_boot(void);
+static void start_secondary_harts(uint32_t hartid) {
+    for (long hid = 0; hid < MAX_HARTS; hid++) {
+        enum SBI_HSM_STATE status = hart_get_status(hid);
+        if (status == SBI_HSM_STATE_ERROR) {
+            num_harts = hid;
+            break;
+        }
+        if (kernel_verbose && hid + 1 == MAX_HARTS)
+            kprintf("There may be more than %d harts...\n", MAX_HARTS);
+    }
+    kprintf("There are %d harts, booting from Hart #%ld.\n", num_harts, boot_hart_id);
+
+    for (uint32_t start_hart = 0; start_hart < num_harts; start_hart++) {
+        if (start_hart == hartid)
+            continue;
+        kprintf("Going to try starting Hart %d.\n", start_hart);
+        // The page is the new hart's stack, which grows down from the end of the page.
+        paddr_t page = alloc_pages(1);
+        sbi_call(start_hart, (uint32_t)&secondary_boot, (uint32_t)page + PAGE_SIZE, 0, 0, 0, SBI_HSM_FN_HART_START,
+                 SBI_EXT_HSM);
+    }
+}
+
 void kernel_main(uint32_t hartid, const fdt_header *fdt) {
     memset_s(__bss, (size_t)__bss_end - (size_t)__bss, 0, (size_t)__bss_end - (size_t)__bss);
     WRITE_CSR(stvec, (uint32_t)kernel_entry);
@@ -302,15 +333,30 @@ void kernel_main(uint32_t hartid, const fdt_header *fdt) {
                          : "gp", "tp" // Clobbers
     );
 
+    struct memory_map memory_map;
+    device_tree_memory_map(fdt, &memory_map);
+    init_page_allocator(&memory_map);
     init_root_slabs();
     init_streams();
+    init_processes();
+    init_pci();
+    init_fat();
+    init_ustar();
     heart_locals[hartid].stdout = create_stream(STREAM_OUT, &stdout, true, true);
 
+    // Lets user programs time themselves with `rdtime`.
+    WRITE_CSR(scounteren, SCOUNTEREN_TM);
     WRITE_CSR(sstatus, READ_CSR(sstatus) | SSTATUS_ENABLE_SIE);
     WRITE_CSR(sie, READ_CSR(sie) | SIE_EXTERNAL | SIE_TIMERS);
 
 #ifdef TESTS
+    page_test_suite();
     slab_test_suite();
+    init_kernel_page_table();
+    process_test_suite();
+    start_secondary_harts(hartid);
+    slab_smp_test(true);
+    page_magazine_dbg();
 #else
     device_tree_init(fdt);
     printf("\n\n"
@@ -333,25 +379,9 @@ void kernel_main(uint32_t hartid, const fdt_header *fdt) {
         putchar('\n');
     }
 
-    for (long hid = 0; hid < MAX_HARTS; hid++) {
-        enum SBI_HSM_STATE status = hart_get_status(hid);
-        if (status == SBI_HSM_STATE_ERROR) {
-            num_harts = hid;
-            break;
-        }
-        if (kernel_verbose && hid + 1 == MAX_HARTS)
-            kprintf("There may be more than %d harts...\n", MAX_HARTS);
-    }
-    kprintf("There are %d harts, booting from Hart #%ld.\n", num_harts, boot_hart_id);
-
-    for (uint32_t start_hart = 0; start_hart < num_harts; start_hart++) {
-        if (start_hart == hartid)
-            continue;
-        kprintf("Going to try starting Hart %d.\n", start_hart);
-        paddr_t page = alloc_pages(1);
-        sbi_call(start_hart, (uint32_t)&secondary_boot, (uint32_t)page, 0, 0, 0, SBI_HSM_FN_HART_START, SBI_EXT_HSM);
-    }
+    start_secondary_harts(hartid);
 
+    init_kernel_page_table();
     hart_local *hl = get_hart_local();
     hl->idle_proc = create_process(NULL, 0);
     set_current_proc(hl->idle_proc);
@@ -375,21 +405,33 @@ void kernel_main(uint32_t hartid, const fdt_header *fdt) {
     }
 
     if (strstr(bootargs, CSTR("noinit")).head == NULL) {
-        struct file *file = fs_lookup("fat0:/shell.cpp.elf");
+        // `init=<path>` starts another program instead of the shell, e.g. `init=fat0:/mallocbench.elf`.
+        char init_path[MAX_FILENAME_LENGTH] = "fat0:/shell.cpp.elf";
+        static const char init_arg[] = "init=";
+        const_string found = strstr(bootargs, (const_string){.head = init_arg, .tail = init_arg + sizeof init_arg - 1});
+        if (found.head != NULL) {
+            size_t length = 0;
+            while (found.tail + length < bootargs.tail && found.tail[length] != ' ' && found.tail[length] != '\0' &&
+                   length < sizeof init_path - 1)
+                length++;
+            memcpy_s(init_path, sizeof init_path, found.tail, length);
+            init_path[length] = '\0';
+        }
+        struct file *file = fs_lookup(init_path);
         if (file == NULL)
-            PANIC("Could not find `init.elf`!\n");
+            PANIC("Could not find `%S`!\n", init_path);
         // kprintf("File is %p\n", file);
-        void *const pages = (void *)alloc_pages(file->size / PAGE_SIZE);
-        const size_t read = file->super.filesystem->read_file(file->super.filesystem, pages, file->super.name);
-        if (read == file->size) {
+        // The process faults its pages in from the image, which is freed once the process has been reaped.
+        struct elf_image *image = load_elf_image(file);
+        if (image != NULL) {
             // if (inspect_elf((paddr_t)file->data)) {
-            process *proc = create_process_elf((elf32_header *)pages);
+            process *proc = create_process_elf(image);
             kprintf("Starting process %hd...\n\n", proc->pid);
             yield();
             kprintf("Returned from init.\n");
             // }
         } else {
-            kprintf(ANSI_RED "Only read %zu bytes of a seemingly %zu-byte file... Not launching `init.elf`!\n");
+            kprintf(ANSI_RED "Not launching `%S`!\n", init_path);
         }
     } else {
         kprintf("Kernel was passed `noinit`, not initializing user-space.\n");
@@ -406,12 +448,23 @@ void kernel_main(uint32_t hartid, const fdt_header *fdt) {
                 continue;
             }
             printf("Found file on a %S filesystem (`%S`)\n", file0->super.filesystem->type_name, *file0->super.name);
-            if ((file0->size / PAGE_SIZE) > pages_size)
-                pages = (void *)alloc_pages(file0->size / PAGE_SIZE);
+            if (align_up(file0->size, PAGE_SIZE) / PAGE_SIZE > pages_size) {
+                if (pages != NULL)
+                    free_pages((paddr_t)pages, pages_size);
+                pages_size = align_up(file0->size, PAGE_SIZE) / PAGE_SIZE;
+                pages = (void *)alloc_pages(pages_size);
+            }
             const size_t read = file0->super.filesystem->read_file(file0->super.filesystem, pages, file0->super.name);
             printf("Read %zu bytes of %zu-byte file. CRC32 checksum: 0x%08X. File magic: \"%S\".\n\n", read,
                    file0->size, crc32buf(pages, read), (const char *)pages);
         }
+        if (pages != NULL)
+            free_pages((paddr_t)pages, pages_size);
+
+        // Sequential reads straight off each disk, to see what the block layer costs on its own.
+        struct block_device *dev = block_device_chain_head;
+        for (; dev != NULL; dev = (struct block_device *)dev->super.next)
+            virtio_blk_bench(dev);
 
         // struct file *file2 = fs_lookup("ustar0:/init.elf");
         // printf("\nFound file: %p (`%S`)\n", file2, *file2->super.name);
@@ -426,12 +479,13 @@ void kernel_main(uint32_t hartid, const fdt_header *fdt) {
     }
 
     // if (kernel_verbose) {
-    slab_dbg(&root_slab4);
-    slab_dbg(&root_slab8);
-    slab_dbg(&root_slab16);
-    slab_dbg(&root_slab32);
-    slab_dbg(&root_slab64);
+#define X(SIZE, PAGES) slab_dbg(&root_slab##SIZE);
+    SLAB_SIZES
+#undef X
+    for (struct kmem_cache *cache = kmem_caches; cache != NULL; cache = cache->next)
+        slab_dbg(cache);
     // }
+    page_magazine_dbg();
 
 #endif
 
@@ -439,7 +493,8 @@ void kernel_main(uint32_t hartid, const fdt_header *fdt) {
     kernel_shutdown(hartid);
 }
 
-void handle_syscall(struct trap_frame *f) {
+// `user_pc` is the address of the `ecall`.
+void handle_syscall(struct trap_frame *f, uint32_t user_pc) {
     // kprintf("Handling syscall on core #%d\n", get_hart_local()->hartid);
     switch (f->a3) {
     case SYS_YIELD:
@@ -470,8 +525,16 @@ void handle_syscall(struct trap_frame *f) {
         process *current_proc = get_current_proc();
         kprintf("process %hd exited\n", current_proc->pid);
         current_proc->state = PROC_EXITED;
+        // Its ASID won't be handed out again this generation, but there's no point keeping its translations around.
+        flush_asid(&current_proc->asid);
         yield();
         PANIC("unreachable");
+    case SYS_FORK:
+        f->a0 = fork_process(get_current_proc(), f, user_pc + 4)->pid;
+        break;
+    case SYS_SBRK:
+        f->a0 = process_sbrk(get_current_proc(), (int32_t)f->a0);
+        break;
     case SYS_READFILE:
     case SYS_WRITEFILE: {
         const char *filename = (const char *)f->a0;
@@ -558,8 +621,20 @@ __attribute__((used)) void handle_trap(struct trap_frame *f) {
                   user_pc);
         }
     } else if (scause == SCAUSE_ECALL) {
-        handle_syscall(f);
+        handle_syscall(f, user_pc);
         user_pc += 4;
+    } else if (scause == SCAUSE_INSTRUCTION_PAGE_FAULT || scause == SCAUSE_LOAD_PAGE_FAULT ||
+               scause == SCAUSE_STORE_PAGE_FAULT) {
+        process *current_proc = get_current_proc();
+        if (!handle_page_fault(current_proc, stval, scause)) {
+            if (sstatus & SSTATUS_SPP)
+                PANIC("kernel page fault scause=%lx, stval=%lx, sepc=%lx\n", scause, stval, user_pc);
+            kprintf(ANSI_RED "process %hd: segmentation fault at %p (sepc=%p)\n", current_proc->pid, stval, user_pc);
+            current_proc->state = PROC_EXITED;
+            flush_asid(&current_proc->asid);
+            yield();
+            PANIC("unreachable");
+        }
     } else {
         const char *cause = "unknown";
         switch (scause) {
@@ -1,18 +1,549 @@
 #include <common.h>
+#include <harts.h>
 #include <kernel.h>
 #include <memory/page_allocator.h>
+#include <memory/slab_allocator.h>
+#include <spinlock.h>
+#include <stdio.h>
 #include <string.h>
 
-extern char __free_ram[], __free_ram_end[];
+#ifdef PAGE_DEBUG
+#define PAGE_DBG(...) KDBG("PAGE-CORE", __VA_ARGS__)
+#else
+#define PAGE_DBG(...)
+#endif
+
+extern char __free_ram[];
+
+// Free blocks are kept in per-order doubly-linked lists, with the list node stored in the first bytes of the block.
+struct free_block {
+    struct free_block *next, *prev;
+};
+
+#define NO_BLOCK ((size_t)-1)
+
+static struct free_block *free_lists[PAGE_MAX_ORDER + 1] = {};
+// Physical address of frame #0. Aligned to the largest block size, so that buddies are naturally aligned.
+static paddr_t base_paddr = 0, managed_start = 0;
+static size_t frame_count = 0, free_frames = 0;
+// Metadata for every frame from `base_paddr` to `ram_end`.
+static struct page *frames = NULL;
+
+paddr_t ram_start = 0, ram_end = 0;
+static struct spinlock page_lock = {.name = "PAGES", .locked = 0, .hart = 0};
+
+// Pages that idle harts have already zeroed.
+static paddr_t clean_pages[PAGE_CLEAN_POOL_SIZE];
+static volatile uint32_t clean_count = 0;
+static struct spinlock clean_lock = {.name = "CLEAN-PAGES", .locked = 0, .hart = 0};
+
+static inline size_t frame_of(paddr_t paddr) { return (paddr - base_paddr) / PAGE_SIZE; }
+static inline paddr_t paddr_of(size_t frame) { return base_paddr + frame * PAGE_SIZE; }
+
+// Handed out, with or without a `kmalloc()` mark.
+static inline bool is_allocated(enum page_state state) {
+    return state == PG_ALLOCATED || state == PG_SLAB || state == PG_LARGE;
+}
+
+static inline uint8_t order_for(uint32_t n) {
+    uint8_t order = 0;
+    while ((1u << order) < n)
+        order++;
+    return order;
+}
+
+static void push_block(size_t frame, uint8_t order) {
+    struct free_block *block = (struct free_block *)paddr_of(frame);
+    block->prev = NULL;
+    block->next = free_lists[order];
+    if (block->next != NULL)
+        block->next->prev = block;
+    free_lists[order] = block;
+    frames[frame] = (struct page){.state = PG_FREE, .order = order};
+}
+
+static void unlink_block(size_t frame, uint8_t order) {
+    struct free_block *block = (struct free_block *)paddr_of(frame);
+    if (block->prev != NULL)
+        block->prev->next = block->next;
+    else
+        free_lists[order] = block->next;
+    if (block->next != NULL)
+        block->next->prev = block->prev;
+    frames[frame].state = PG_ALLOCATED;
+}
+
+// Frees the `1 << order` frames starting at `frame`, merging with the block's buddy for as long as it is also free.
+static void release_block(size_t frame, uint8_t order) {
+    while (order < PAGE_MAX_ORDER) {
+        size_t buddy = frame ^ (1u << order);
+        if (buddy >= frame_count || frames[buddy].state != PG_FREE || frames[buddy].order != order)
+            break;
+        PAGE_DBG("Merging order-%hhu block #%zu with its buddy #%zu.\n", order, frame, buddy);
+        unlink_block(buddy, order);
+        frame &= ~(size_t)(1u << order);
+        order++;
+    }
+    push_block(frame, order);
+}
+
+// Frees `count` frames starting at `frame`, as the largest naturally aligned blocks that fit.
+static void release_range(size_t frame, size_t count) {
+    while (count) {
+        uint8_t order = 0;
+        while (order < PAGE_MAX_ORDER && (frame & ((2u << order) - 1)) == 0 && (2u << order) <= count)
+            order++;
+        release_block(frame, order);
+        frame += 1u << order;
+        count -= 1u << order;
+    }
+}
+
+// Removes a block of `1 << order` frames from the free lists, splitting a larger block if need be. Returns `NO_BLOCK`
+// if there is no block large enough. Must be called with `page_lock` held.
+static size_t take_block(uint8_t order) {
+    uint8_t found = order;
+    while (found <= PAGE_MAX_ORDER && free_lists[found] == NULL)
+        found++;
+    if (found > PAGE_MAX_ORDER)
+        return NO_BLOCK;
+
+    const size_t frame = frame_of((paddr_t)free_lists[found]);
+    unlink_block(frame, found);
+    // Split the block down to the requested order, returning the upper halves to the free lists.
+    while (found > order) {
+        found--;
+        push_block(frame + (1u << found), found);
+    }
+    return frame;
+}
+
+// Moves up to `PAGE_MAGAZINE_BATCH` pages from the free lists into `mag`. Must be called with `page_lock` held.
+static void refill_magazine(struct page_magazine *mag) {
+    for (size_t i = 0; i < PAGE_MAGAZINE_BATCH; i++) {
+        const size_t frame = take_block(0);
+        if (frame == NO_BLOCK)
+            break;
+        frames[frame].state = PG_MAGAZINE;
+        mag->pages[mag->count++] = paddr_of(frame);
+        free_frames--;
+    }
+    PAGE_DBG("Refilled hart #%u's magazine to %u pages.\n", get_hart_local()->hartid, mag->count);
+}
+
+// Returns `count` pages from `mag` to the free lists. Must be called with `page_lock` held.
+static void drain_magazine(struct page_magazine *mag, uint32_t count) {
+    while (count-- && mag->count) {
+        const size_t frame = frame_of(mag->pages[--mag->count]);
+        frames[frame].state = PG_ALLOCATED;
+        release_block(frame, 0);
+        free_frames++;
+    }
+}
+
+static void set_state(paddr_t start, paddr_t end, enum page_state state) {
+    if (end <= base_paddr)
+        return;
+    if (start < base_paddr)
+        start = base_paddr;
+    for (size_t frame = frame_of(align_down(start, PAGE_SIZE)); frame < frame_count && paddr_of(frame) < end; frame++)
+        frames[frame].state = state;
+}
+
+void init_page_allocator(const struct memory_map *map) {
+    if (map->ram_count == 0)
+        PANIC("The device tree does not describe any RAM!\n");
+    ram_start = map->ram[0].start;
+    ram_end = map->ram[0].end;
+    for (size_t i = 1; i < map->ram_count; i++) {
+        if (map->ram[i].start < ram_start)
+            ram_start = map->ram[i].start;
+        if (map->ram[i].end > ram_end)
+            ram_end = map->ram[i].end;
+    }
+    ram_end = align_down(ram_end, PAGE_SIZE);
+    base_paddr = align_down(ram_start, PAGE_SIZE << PAGE_MAX_ORDER);
+    frame_count = (ram_end - base_paddr) / PAGE_SIZE;
+
+    // The frame table lives at the very start of free RAM, right after the kernel image.
+    frames = (struct page *)__free_ram;
+    const size_t table_size = frame_count * sizeof(struct page);
+    managed_start = align_up((paddr_t)__free_ram + table_size, PAGE_SIZE);
+    for (size_t i = 0; i < map->reserved_count; i++) {
+        if (map->reserved[i].start < managed_start && map->reserved[i].end > (paddr_t)__free_ram)
+            PANIC("Reserved memory %p-%p overlaps the frame table at %p-%p!\n", map->reserved[i].start,
+                  map->reserved[i].end, __free_ram, managed_start);
+    }
+
+    // Everything starts out reserved; then usable RAM above the frame table is carved out, minus any reservations.
+    memset_s(frames, table_size, 0, table_size);
+    set_state(base_paddr, ram_end, PG_RESERVED);
+    for (size_t i = 0; i < map->ram_count; i++) {
+        const paddr_t start = align_up(map->ram[i].start, PAGE_SIZE), end = align_down(map->ram[i].end, PAGE_SIZE);
+        set_state(start < managed_start ? managed_start : start, end, PG_ALLOCATED);
+    }
+    for (size_t i = 0; i < map->reserved_count; i++)
+        set_state(map->reserved[i].start, map->reserved[i].end, PG_RESERVED);
+
+    for (size_t frame = frame_of(managed_start); frame < frame_count;) {
+        if (frames[frame].state != PG_ALLOCATED) {
+            frame++;
+            continue;
+        }
+        size_t count = 0;
+        while (frame + count < frame_count && frames[frame + count].state == PG_ALLOCATED)
+            count++;
+        release_range(frame, count);
+        free_frames += count;
+        frame += count;
+    }
+    PAGE_DBG("Managing %zu free pages (%zuKiB) of RAM from %p to %p.\n", free_frames, free_frames * (PAGE_SIZE / 1024),
+             ram_start, ram_end);
+}
+
+// Single pages come from this hart's magazine, only touching `page_lock` when it needs refilling.
+static paddr_t alloc_page(void) {
+    paddr_t paddr = 0;
+    push_off();
+    struct page_magazine *mag = &get_hart_local()->pages;
+    if (mag->count == 0) {
+        mag->misses++;
+        acquire(&page_lock);
+        refill_magazine(mag);
+        release(&page_lock);
+    } else {
+        mag->hits++;
+    }
+    if (mag->count != 0) {
+        paddr = mag->pages[--mag->count];
+        frames[frame_of(paddr)].state = PG_ALLOCATED;
+    }
+    pop_off();
+    return paddr;
+}
+
+static paddr_t take_clean_page(void) {
+    // Peek without the lock first, so that allocations don't contend with the idle harts while the pool is empty.
+    if (clean_count == 0)
+        return 0;
+    paddr_t paddr = 0;
+    acquire(&clean_lock);
+    if (clean_count != 0) {
+        paddr = clean_pages[--clean_count];
+        frames[frame_of(paddr)].state = PG_ALLOCATED;
+    }
+    release(&clean_lock);
+    return paddr;
+}
+
+// Returns every pre-zeroed page to the free lists, so that they can merge back into larger blocks.
+static void drain_clean_pages(void) {
+    acquire(&clean_lock);
+    acquire(&page_lock);
+    while (clean_count != 0) {
+        const size_t frame = frame_of(clean_pages[--clean_count]);
+        frames[frame].state = PG_ALLOCATED;
+        release_block(frame, 0);
+        free_frames++;
+    }
+    release(&page_lock);
+    release(&clean_lock);
+}
+
+bool zero_free_page(void) {
+    if (clean_count >= PAGE_CLEAN_POOL_SIZE || free_frames == 0)
+        return false;
+    // Straight from the free lists, so that background zeroing neither drains this hart's magazine nor skews its stats.
+    acquire(&page_lock);
+    const size_t frame = take_block(0);
+    if (frame == NO_BLOCK) {
+        release(&page_lock);
+        return false;
+    }
+    frames[frame].state = PG_ALLOCATED;
+    free_frames--;
+    release(&page_lock);
+    const paddr_t paddr = paddr_of(frame);
+    memset_s((void *)paddr, PAGE_SIZE, 0, PAGE_SIZE);
+
+    acquire(&clean_lock);
+    if (clean_count < PAGE_CLEAN_POOL_SIZE) {
+        frames[frame_of(paddr)].state = PG_CLEAN;
+        clean_pages[clean_count++] = paddr;
+        release(&clean_lock);
+        return true;
+    }
+    release(&clean_lock);
+    // Someone else filled the pool in the meantime.
+    acquire(&page_lock);
+    release_block(frame, 0);
+    free_frames++;
+    release(&page_lock);
+    return false;
+}
 
 paddr_t alloc_pages(uint32_t n) {
-    static paddr_t next_paddr = (paddr_t)__free_ram;
-    paddr_t paddr = next_paddr;
-    next_paddr += n * PAGE_SIZE;
+    if (n <= 1) {
+        paddr_t paddr = take_clean_page();
+        if (paddr != 0)
+            return paddr;
+        paddr = alloc_page();
+        // Before giving up, have the slabs hand back their empty caches.
+        if (paddr == 0 && slab_shrink_all(true) != 0)
+            paddr = alloc_page();
+        if (paddr == 0)
+            PANIC("out of memory (wanted 1 page, %zu pages free)", free_page_count());
+        memset_s((void *)paddr, PAGE_SIZE, 0, PAGE_SIZE);
+        return paddr;
+    }
+    const uint8_t order = order_for(n);
 
-    if (next_paddr > (paddr_t)__free_ram_end)
-        PANIC("out of memory");
+    acquire(&page_lock);
+    size_t frame = take_block(order);
+    if (frame == NO_BLOCK) {
+        // Before giving up, have the slabs hand back their empty caches, and the pre-zeroed pool its pages.
+        release(&page_lock);
+        slab_shrink_all(true);
+        drain_clean_pages();
+        acquire(&page_lock);
+        frame = take_block(order);
+    }
+    if (frame == NO_BLOCK) {
+        release(&page_lock);
+        PANIC("out of memory (wanted %u contiguous pages, %zu pages free)", n, free_page_count());
+    }
+    // Give back whatever tail the caller didn't ask for.
+    if (n < (1u << order))
+        release_range(frame + n, (1u << order) - n);
+    free_frames -= n;
+    release(&page_lock);
 
+    paddr_t paddr = paddr_of(frame);
     memset_s((void *)paddr, n * PAGE_SIZE, 0, n * PAGE_SIZE);
     return paddr;
 }
+
+void free_pages(paddr_t paddr, uint32_t n) {
+    if (!is_aligned(paddr, PAGE_SIZE))
+        PANIC("unaligned paddr %x", paddr);
+    if (paddr < managed_start || frame_of(paddr) + n > frame_count)
+        PANIC("Freeing %u pages at %p, which is outside of managed memory!\n", n, paddr);
+
+    const size_t frame = frame_of(paddr);
+    if (frames[frame].state == PG_RESERVED)
+        PANIC("Freeing %u pages at %p, which is reserved memory!\n", n, paddr);
+    if (n == 1) {
+        push_off();
+        if (!is_allocated(frames[frame].state)) {
+            pop_off();
+            PANIC("Double-free of page %p!\n", paddr);
+        }
+        struct page_magazine *mag = &get_hart_local()->pages;
+        if (mag->count == PAGE_MAGAZINE_SIZE) {
+            acquire(&page_lock);
+            drain_magazine(mag, PAGE_MAGAZINE_BATCH);
+            release(&page_lock);
+        }
+        frames[frame] = (struct page){.state = PG_MAGAZINE};
+        mag->pages[mag->count++] = paddr;
+        pop_off();
+        return;
+    }
+
+    acquire(&page_lock);
+    if (!is_allocated(frames[frame].state)) {
+        release(&page_lock);
+        PANIC("Double-free of page %p!\n", paddr);
+    }
+    // Forget any `kmalloc()` marks.
+    for (size_t i = 0; i < n; i++)
+        frames[frame + i] = (struct page){.state = PG_ALLOCATED};
+    release_range(frame, n);
+    free_frames += n;
+    release(&page_lock);
+}
+
+static struct page *shared_page(paddr_t paddr) {
+    if (!is_aligned(paddr, PAGE_SIZE) || paddr < managed_start || frame_of(paddr) >= frame_count)
+        PANIC("Page %p is not a managed page!\n", paddr);
+    struct page *page = &frames[frame_of(paddr)];
+    if (page->state != PG_ALLOCATED)
+        PANIC("Page %p is not allocated!\n", paddr);
+    return page;
+}
+
+void page_get(paddr_t paddr) {
+    struct page *page = shared_page(paddr);
+    acquire(&page_lock);
+    if (page->refs == (uint16_t)-1) {
+        release(&page_lock);
+        PANIC("Too many references to page %p!\n", paddr);
+    }
+    page->refs++;
+    release(&page_lock);
+}
+
+void page_put(paddr_t paddr) {
+    struct page *page = shared_page(paddr);
+    acquire(&page_lock);
+    if (page->refs > 0) {
+        page->refs--;
+        release(&page_lock);
+        return;
+    }
+    release(&page_lock);
+    free_pages(paddr, 1);
+}
+
+bool page_shared(paddr_t paddr) { return shared_page(paddr)->refs > 0; }
+
+static struct page *managed_page(paddr_t paddr) {
+    if (paddr < managed_start || frame_of(paddr) >= frame_count)
+        PANIC("Page %p is not a managed page!\n", paddr);
+    return &frames[frame_of(paddr)];
+}
+
+void page_mark_slab(paddr_t paddr, uint32_t n, uint8_t size_class) {
+    for (uint32_t i = 0; i < n; i++) {
+        struct page *page = managed_page(paddr + i * PAGE_SIZE);
+        if (page->state != PG_ALLOCATED)
+            PANIC("Page %p is not allocated!\n", paddr + i * PAGE_SIZE);
+        *page = (struct page){.state = PG_SLAB, .order = size_class};
+    }
+}
+
+void page_mark_large(paddr_t paddr, uint32_t n) {
+    struct page *page = managed_page(paddr);
+    if (page->state != PG_ALLOCATED)
+        PANIC("Page %p is not allocated!\n", paddr);
+    if (n > (uint16_t)-1)
+        PANIC("Cannot mark a block of %u pages!\n", n);
+    *page = (struct page){.state = PG_LARGE, .pages = n};
+}
+
+struct page page_info(paddr_t paddr) { return *managed_page(paddr); }
+
+size_t free_page_count(void) {
+    size_t count = free_frames + clean_count;
+    for (size_t i = 0; i < MAX_HARTS; i++)
+        count += heart_locals[i].pages.count;
+    return count;
+}
+
+void page_magazine_dbg(void) {
+    for (size_t i = 0; i < MAX_HARTS; i++) {
+        const struct page_magazine *mag = &heart_locals[i].pages;
+        const uint32_t total = mag->hits + mag->misses;
+        if (total == 0)
+            continue;
+        const uint32_t permille = ((uint64_t)mag->hits * 1000) / total;
+        kprintf("Hart #%zu: %u of %u single-page allocations hit its magazine (%u.%u%%), %u/%d pages cached.\n", i,
+                mag->hits, total, permille / 10, permille % 10, mag->count, PAGE_MAGAZINE_SIZE);
+    }
+    kprintf("%u/%d pre-zeroed pages pooled.\n", clean_count, PAGE_CLEAN_POOL_SIZE);
+}
+
+#ifdef TESTS
+
+#define PAGE_TEST_BATCH 512
+
+// Returns this hart's cached pages to the free lists, so that coalescing can be observed.
+static void flush_magazine(void) {
+    push_off();
+    acquire(&page_lock);
+    drain_magazine(&get_hart_local()->pages, PAGE_MAGAZINE_SIZE);
+    release(&page_lock);
+    pop_off();
+}
+
+static size_t count_blocks(uint8_t order) {
+    flush_magazine();
+    size_t count = 0;
+    for (struct free_block *b = free_lists[order]; b != NULL; b = b->next)
+        count++;
+    return count;
+}
+
+static void report(const char *name, size_t ops, uint32_t ticks) {
+    if (ticks == 0)
+        ticks = 1;
+    const uint32_t ns = ((uint64_t)ticks * 1000000000) / CLOCK_FREQ / ops;
+    printf("[PAGE-TESTS] %S: %zu operations in %u ticks (%u.%03uus each, ~%u ops/s).\n", name, ops, ticks, ns / 1000,
+           ns % 1000, (uint32_t)(((uint64_t)ops * CLOCK_FREQ) / ticks));
+}
+
+void page_test_suite(void) {
+    const size_t initial_free = free_page_count(), initial_max = count_blocks(PAGE_MAX_ORDER);
+    printf("[PAGE-TESTS] %zu pages free, %zu order-%d blocks.\n", initial_free, initial_max, PAGE_MAX_ORDER);
+
+    /* Check alignment and tail trimming. */
+    for (uint32_t n = 1; n <= 16; n++) {
+        paddr_t block = alloc_pages(n);
+        if ((n & (n - 1)) == 0 && !is_aligned(block, n * PAGE_SIZE))
+            PANIC("[PAGE-TESTS] %u-page block at %p is not naturally aligned!\n", n, block);
+        if (free_page_count() != initial_free - n)
+            PANIC("[PAGE-TESTS] Allocating %u pages consumed %zu pages!\n", n, initial_free - free_page_count());
+        free_pages(block, n);
+    }
+
+    /* Pages of a multi-page allocation can be returned one at a time, in any order. */
+    paddr_t block = alloc_pages(5);
+    free_pages(block + 2 * PAGE_SIZE, 1);
+    free_pages(block, 2);
+    free_pages(block + 4 * PAGE_SIZE, 1);
+    free_pages(block + 3 * PAGE_SIZE, 1);
+
+    if (free_page_count() != initial_free || count_blocks(PAGE_MAX_ORDER) != initial_max)
+        PANIC("[PAGE-TESTS] Memory did not coalesce back to its initial state (%zu/%zu pages, %zu/%zu blocks)!\n",
+              free_page_count(), initial_free, count_blocks(PAGE_MAX_ORDER), initial_max);
+    printf("[PAGE-TESTS] Allocation, trimming and coalescing look correct.\n");
+
+    /* Throughput. */
+    paddr_t pages[PAGE_TEST_BATCH];
+    uint32_t start = READ_CSR(time);
+    for (size_t i = 0; i < PAGE_TEST_BATCH; i++)
+        free_pages(alloc_pages(1), 1);
+    report("alloc+free (1 page, LIFO)", PAGE_TEST_BATCH, READ_CSR(time) - start);
+
+    start = READ_CSR(time);
+    for (size_t i = 0; i < PAGE_TEST_BATCH; i++)
+        pages[i] = alloc_pages(1);
+    report("alloc (1 page, batch)", PAGE_TEST_BATCH, READ_CSR(time) - start);
+
+    start = READ_CSR(time);
+    for (size_t i = 0; i < PAGE_TEST_BATCH; i += 2)
+        free_pages(pages[i], 1);
+    for (size_t i = 1; i < PAGE_TEST_BATCH; i += 2)
+        free_pages(pages[i], 1);
+    report("free (1 page, interleaved)", PAGE_TEST_BATCH, READ_CSR(time) - start);
+
+    start = READ_CSR(time);
+    for (size_t i = 0; i < PAGE_TEST_BATCH; i++)
+        pages[i] = alloc_pages((i % 8) + 1);
+    for (size_t i = 0; i < PAGE_TEST_BATCH; i++)
+        free_pages(pages[PAGE_TEST_BATCH - 1 - i], ((PAGE_TEST_BATCH - 1 - i) % 8) + 1);
+    report("alloc+free (1-8 pages, mixed)", PAGE_TEST_BATCH, READ_CSR(time) - start);
+
+    /* Pre-zeroed pages, as the idle harts would leave them. */
+    size_t clean = 0;
+    while (zero_free_page())
+        clean++;
+    start = READ_CSR(time);
+    for (size_t i = 0; i < clean; i++)
+        pages[i] = alloc_pages(1);
+    report("alloc (1 page, pre-zeroed)", clean, READ_CSR(time) - start);
+    for (size_t i = 0; i < clean; i++) {
+        for (size_t off = 0; off < PAGE_SIZE; off += sizeof(uint32_t)) {
+            if (*(uint32_t *)(pages[i] + off) != 0)
+                PANIC("[PAGE-TESTS] Pre-zeroed page %p is dirty at offset %zu!\n", pages[i], off);
+        }
+        free_pages(pages[i], 1);
+    }
+
+    if (free_page_count() != initial_free || count_blocks(PAGE_MAX_ORDER) != initial_max)
+        PANIC("[PAGE-TESTS] Leaked pages during benchmark (%zu/%zu pages, %zu/%zu blocks)!\n", free_page_count(),
+              initial_free, count_blocks(PAGE_MAX_ORDER), initial_max);
+    printf("[PAGE-TESTS] Done.\n");
+}
+
+#endif
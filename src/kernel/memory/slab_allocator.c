@@ -1,31 +1,32 @@
 #include "stddef.h"
 #include <color.h>
 #include <common.h>
+#include <harts.h>
 #include <kernel.h>
 #include <memory/slab_allocator.h>
+#include <spinlock.h>
 #include <stdio.h>
 
 #include <memory_mgmt.h>
 
 #ifdef SLAB_DEBUG
 #define SLAB_DBG(...) KDBG("SLAB-CORE", __VA_ARGS__)
+// Cross-check the bookkeeping on every free (slow).
+#define SLAB_CHECKS true
 #else
 #define SLAB_DBG(...)
+#define SLAB_CHECKS false
 #endif
 
-struct slab_4 root_slab4;
-struct slab_8 root_slab8;
-struct slab_16 root_slab16;
-struct slab_32 root_slab32;
-struct slab_64 root_slab64;
+#define X(SIZE, PAGES) struct slab_##SIZE root_slab##SIZE;
+SLAB_SIZES
+#undef X
 
 void init_root_slabs(void) {
     // kprintf("Initializing root slab allocators...\n");
-    create_slab(&root_slab4);
-    create_slab(&root_slab8);
-    create_slab(&root_slab16);
-    create_slab(&root_slab32);
-    create_slab(&root_slab64);
+#define X(SIZE, PAGES) create_slab(&root_slab##SIZE);
+    SLAB_SIZES
+#undef X
 }
 
 #define SLAB(SIZE, PAGES_PER_SLAB)                                                                                     \
@@ -38,6 +39,7 @@ void init_root_slabs(void) {
         slab->first_full = NULL;                                                                                       \
         slab->first_empty = NULL;                                                                                      \
         slab->first_partial = NULL;                                                                                    \
+        slab->max_empty = SLAB_MAX_EMPTY;                                                                              \
         /* cache->slab = slab;*/                                                                                       \
         /* cache->first_free = cache->entries;                                                                         \
         for (size_t i = 1; i < capacity; i++)                                                                          \
@@ -45,115 +47,194 @@ void init_root_slabs(void) {
         cache->entries[capacity - 1].next = NULL; */                                                                   \
     }                                                                                                                  \
                                                                                                                        \
-    void *slab_alloc_##SIZE(struct slab_##SIZE *slab) {                                                                \
+    static inline void cache_unlink_##SIZE(struct cache_##SIZE **list, struct cache_##SIZE *cache) {                   \
+        if (cache->prev_cache != NULL)                                                                                 \
+            cache->prev_cache->next_cache = cache->next_cache;                                                         \
+        else                                                                                                           \
+            *list = cache->next_cache;                                                                                 \
+        if (cache->next_cache != NULL)                                                                                 \
+            cache->next_cache->prev_cache = cache->prev_cache;                                                         \
+        cache->next_cache = cache->prev_cache = NULL;                                                                  \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline void cache_push_##SIZE(struct cache_##SIZE **list, struct cache_##SIZE *cache) {                     \
+        cache->prev_cache = NULL;                                                                                      \
+        cache->next_cache = *list;                                                                                     \
+        if (*list != NULL)                                                                                             \
+            (*list)->prev_cache = cache;                                                                               \
+        *list = cache;                                                                                                 \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline size_t cache_capacity_##SIZE(void) {                                                                 \
+        return (PAGE_SIZE * PAGES_PER_SLAB - sizeof(struct cache_##SIZE)) / SIZE;                                      \
+    }                                                                                                                  \
+                                                                                                                       \
+    static void *cache_alloc_##SIZE(struct slab_##SIZE *slab) {                                                        \
         struct cache_##SIZE *cache = slab->first_partial;                                                              \
         if (cache == NULL) {                                                                                           \
             if (slab->first_empty != NULL) {                                                                           \
                 SLAB_DBG("Consumed last partial, getting next empty and moving to partial list.\n");                   \
                 cache = slab->first_empty;                                                                             \
-                slab->first_empty = cache->next_cache;                                                                 \
-                cache->next_cache = NULL;                                                                              \
-                slab->first_partial = cache;                                                                           \
+                cache_unlink_##SIZE(&slab->first_empty, cache);                                                        \
             } else {                                                                                                   \
                 SLAB_DBG("OUT OF CACHES, allocating a new page...\n");                                                 \
-                size_t capacity = (PAGE_SIZE * PAGES_PER_SLAB - sizeof(struct cache_##SIZE)) / SIZE;                   \
+                _Static_assert((PAGES_PER_SLAB & (PAGES_PER_SLAB - 1)) == 0, "Caches must be naturally aligned.");     \
+                const size_t capacity = cache_capacity_##SIZE();                                                       \
                 cache = (struct cache_##SIZE *)alloc_pages(PAGES_PER_SLAB);                                            \
+                page_mark_slab((paddr_t)cache, PAGES_PER_SLAB, SLAB_INDEX_##SIZE);                                     \
                 SLAB_DBG("Capacity of cache at %p is %d objects of %d bytes each (PAGE size minus %d-byte header).\n", \
                          cache, capacity, SIZE, sizeof(struct cache_##SIZE));                                          \
-                /*cache->slab = slab;*/                                                                                \
-                cache->next_cache = NULL;                                                                              \
+                /* The pages come zeroed, so nothing is marked as allocated yet. */                                    \
+                cache->slab = slab;                                                                                    \
                 cache->first_free = cache->entries;                                                                    \
                 for (size_t i = 1; i < capacity; i++)                                                                  \
                     cache->entries[i - 1].next = &cache->entries[i];                                                   \
                 cache->entries[capacity - 1].next = NULL;                                                              \
-                slab->first_partial = cache;                                                                           \
             }                                                                                                          \
+            cache_push_##SIZE(&slab->first_partial, cache);                                                            \
         }                                                                                                              \
-        if (cache == NULL) /* TODO */                                                                                  \
-            PANIC("UNREACHABLE: OUT OF CACHES!\n");                                                                    \
                                                                                                                        \
         struct cache_entry_##SIZE *free = cache->first_free;                                                           \
         if (free == NULL) /* TODO */                                                                                   \
             PANIC("UNREACHABLE: CACHE OUT OF SLOTS\n");                                                                \
                                                                                                                        \
-        struct cache_entry_##SIZE *next = free->next;                                                                  \
-        if (next == NULL) { /* TODO */                                                                                 \
+        const size_t index = free - cache->entries;                                                                    \
+        cache->allocated[index / 32] |= 1u << (index % 32);                                                            \
+        if (++cache->in_use == cache_capacity_##SIZE()) {                                                              \
             SLAB_DBG("CONSUMED LAST CACHE SLOT. Moving to full list.\n");                                              \
-            slab->first_partial = cache->next_cache;                                                                   \
-            cache->next_cache = slab->first_full;                                                                      \
-            slab->first_full = cache;                                                                                  \
+            cache_unlink_##SIZE(&slab->first_partial, cache);                                                          \
+            cache_push_##SIZE(&slab->first_full, cache);                                                               \
         }                                                                                                              \
                                                                                                                        \
-        cache->first_free = next;                                                                                      \
+        cache->first_free = free->next;                                                                                \
         return (void *)free->storage;                                                                                  \
     }                                                                                                                  \
                                                                                                                        \
-    void slab_free_##SIZE(struct slab_##SIZE *slab, void *ptr) {                                                       \
-        struct cache_##SIZE *cache = NULL;                                                                             \
-        /* Search first in partial list... */                                                                          \
-        for (cache = slab->first_partial;                                                                              \
-             cache != NULL && !(ptr > (void *)cache && ptr < (void *)((paddr_t)cache + PAGE_SIZE * PAGES_PER_SLAB));   \
-             cache = cache->next_cache)                                                                                \
-            ;                                                                                                          \
-        if (cache == NULL)                                                                                             \
-            for (cache = slab->first_full;                                                                             \
-                 cache != NULL &&                                                                                      \
-                 !(ptr > (void *)cache && ptr < (void *)((paddr_t)cache + PAGE_SIZE * PAGES_PER_SLAB));                \
-                 cache = cache->next_cache)                                                                            \
-                ;                                                                                                      \
-        if (cache == NULL)                                                                                             \
-            PANIC("Could not find cache that owns pointer %p!", ptr);                                                  \
-        struct cache_entry_##SIZE *e = cache->first_free;                                                              \
-        for (; e != NULL && e != ptr; e = e->next)                                                                     \
-            ;                                                                                                          \
-        if (e != NULL)                                                                                                 \
-            PANIC("Double-free!!\n");                                                                                  \
-        /* TODO: check if this is a double-free! */                                                                    \
-        /*SLAB_DBG("Cache is likely the one at %p\n", cache);*/                                                        \
+    /* Finds the cache owning `ptr`, making sure it is a live object of `slab`. */                                     \
+    static struct cache_##SIZE *cache_of_##SIZE(struct slab_##SIZE *slab, void *ptr) {                                 \
+        struct cache_##SIZE *cache =                                                                                   \
+            (struct cache_##SIZE *)align_down((paddr_t)ptr, PAGE_SIZE * PAGES_PER_SLAB);                               \
+        if (cache->slab != slab || ptr < (void *)cache->entries ||                                                     \
+            ((paddr_t)ptr - (paddr_t)cache->entries) % SIZE != 0)                                                      \
+            PANIC("Pointer %p was not allocated from slab_" #SIZE " %p!\n", ptr, slab);                                \
+        const size_t index = (struct cache_entry_##SIZE *)ptr - cache->entries;                                        \
+        if ((cache->allocated[index / 32] & (1u << (index % 32))) == 0)                                                \
+            PANIC("Double-free of %p!\n", ptr);                                                                        \
+        return cache;                                                                                                  \
+    }                                                                                                                  \
+                                                                                                                       \
+    static void cache_free_##SIZE(struct slab_##SIZE *slab, void *ptr) {                                               \
+        struct cache_##SIZE *cache = cache_of_##SIZE(slab, ptr);                                                       \
         struct cache_entry_##SIZE *entry = (struct cache_entry_##SIZE *)ptr;                                           \
-        bool full = cache->first_free == NULL;                                                                         \
+        const size_t index = entry - cache->entries;                                                                   \
+        if (SLAB_CHECKS) {                                                                                             \
+            /* The bitmap and the free list had better agree. */                                                       \
+            size_t free = 0;                                                                                           \
+            for (struct cache_entry_##SIZE *e = cache->first_free; e != NULL; e = e->next, free++) {                   \
+                if (e == entry)                                                                                        \
+                    PANIC("%p is marked as allocated, but is on the free list!\n", ptr);                               \
+            }                                                                                                          \
+            if (free + cache->in_use != cache_capacity_##SIZE())                                                       \
+                PANIC("Cache %p has %zu free and %u allocated objects, out of %zu!\n", cache, free, cache->in_use,     \
+                      cache_capacity_##SIZE());                                                                        \
+        }                                                                                                              \
+                                                                                                                       \
+        cache->allocated[index / 32] &= ~(1u << (index % 32));                                                         \
         entry->next = cache->first_free;                                                                               \
         cache->first_free = entry;                                                                                     \
-        /* TODO: count cache use, check if it needs to be moved from the full list to the partial list, or from the    \
-         * partial list to the empty list. */                                                                          \
-        size_t count = 0, capacity = (PAGE_SIZE * PAGES_PER_SLAB - sizeof(struct cache_##SIZE)) / SIZE;                \
-        for (struct cache_entry_##SIZE *e = entry; e != NULL; e = e->next)                                             \
-            count++;                                                                                                   \
-        /*SLAB_DBG("Slab appears to have %d free entries (out of %d total, or %d%% free)...\n", count, capacity,       \
-                 (count * 100) / capacity);*/                                                                          \
-        if (full || count == capacity) {                                                                               \
-            /* Move previously full slab to partial list (if full==true) or move previously partial slab to empty list \
-             * (if full==false). */                                                                                    \
-            struct cache_##SIZE *prev = full ? slab->first_full : slab->first_partial;                                 \
-            if (prev == cache)                                                                                         \
-                prev = NULL;                                                                                           \
-            else                                                                                                       \
-                for (; prev != NULL && prev->next_cache != cache; prev = prev->next_cache)                             \
-                    ;                                                                                                  \
-            /*if (prev->next_cache == cache)                                                                           \
-                break;*/                                                                                               \
+        if (cache->in_use-- == cache_capacity_##SIZE()) {                                                              \
+            cache_unlink_##SIZE(&slab->first_full, cache);                                                             \
+            cache_push_##SIZE(&slab->first_partial, cache);                                                            \
+            SLAB_DBG("Moved a full slab to the head of the partial list!\n");                                          \
+        }                                                                                                              \
+        if (cache->in_use == 0) {                                                                                      \
+            cache_unlink_##SIZE(&slab->first_partial, cache);                                                          \
+            cache_push_##SIZE(&slab->first_empty, cache);                                                              \
+            SLAB_DBG("Moved a partial slab to the head of the free list!\n");                                          \
+        }                                                                                                              \
+    }                                                                                                                  \
                                                                                                                        \
-            if (prev == NULL) {                                                                                        \
-                SLAB_DBG("\tCache is the first entry in %s...\n", full ? "full list" : "partial list");                \
-                if (full) {                                                                                            \
-                    slab->first_full = cache->next_cache;                                                              \
-                    SLAB_DBG("\tslab->first_full is now %p...\n", slab->first_full);                                   \
-                } else                                                                                                 \
-                    slab->first_partial = cache->next_cache;                                                           \
-            } else {                                                                                                   \
-                prev->next_cache = cache->next_cache;                                                                  \
-            }                                                                                                          \
+    /* Guards the root slab, the depot that every hart's magazine is refilled from and drained to. */                  \
+    static struct spinlock root_lock##SIZE = {.name = "slab" #SIZE, .locked = 0, .hart = 0};                           \
+                                                                                                                       \
+    /* Moves `SLAB_MAGAZINE_BATCH` objects from the root slab into `mag`. Must be called with the root lock held. */   \
+    static void refill_magazine_##SIZE(struct slab_magazine *mag) {                                                    \
+        for (size_t i = 0; i < SLAB_MAGAZINE_BATCH; i++)                                                               \
+            mag->objects[mag->count++] = cache_alloc_##SIZE(&root_slab##SIZE);                                         \
+        SLAB_DBG("Refilled hart #%u's slab" #SIZE " magazine to %u objects.\n", get_hart_local()->hartid,              \
+                 mag->count);                                                                                          \
+    }                                                                                                                  \
+                                                                                                                       \
+    /* Returns `count` objects from `mag` to the root slab. Must be called with the root lock held. */                 \
+    static void drain_magazine_##SIZE(struct slab_magazine *mag, uint32_t count) {                                     \
+        while (count-- && mag->count)                                                                                  \
+            cache_free_##SIZE(&root_slab##SIZE, mag->objects[--mag->count]);                                           \
+    }                                                                                                                  \
                                                                                                                        \
-            cache->next_cache = full ? slab->first_partial : slab->first_empty;                                        \
-            if (full)                                                                                                  \
-                slab->first_partial = cache;                                                                           \
-            else                                                                                                       \
-                slab->first_empty = cache;                                                                             \
-            SLAB_DBG("Moved %s %s slab to the head of the %s list!\n", prev == NULL ? "the last" : "a",                \
-                     full ? "full" : "partial", full ? "partial" : "free");                                            \
+    /* Root slab objects come from this hart's magazine, only touching the root lock when it needs refilling. */       \
+    void *slab_alloc_##SIZE(struct slab_##SIZE *slab) {                                                                \
+        if (slab != &root_slab##SIZE)                                                                                  \
+            return cache_alloc_##SIZE(slab);                                                                           \
+        push_off();                                                                                                    \
+        struct slab_magazine *mag = &get_hart_local()->slabs[SLAB_INDEX_##SIZE];                                       \
+        if (mag->count == 0) {                                                                                         \
+            mag->misses++;                                                                                             \
+            acquire(&root_lock##SIZE);                                                                                 \
+            refill_magazine_##SIZE(mag);                                                                               \
+            release(&root_lock##SIZE);                                                                                 \
+        } else {                                                                                                       \
+            mag->hits++;                                                                                               \
         }                                                                                                              \
+        void *ptr = mag->objects[--mag->count];                                                                        \
+        pop_off();                                                                                                     \
+        return ptr;                                                                                                    \
     }                                                                                                                  \
                                                                                                                        \
+    void slab_free_##SIZE(struct slab_##SIZE *slab, void *ptr) {                                                       \
+        if (slab != &root_slab##SIZE) {                                                                                \
+            cache_free_##SIZE(slab, ptr);                                                                              \
+            return;                                                                                                    \
+        }                                                                                                              \
+        /* Objects sitting in a magazine are still marked as allocated, so this only catches frees of objects that     \
+           have made it back to their cache. */                                                                        \
+        cache_of_##SIZE(slab, ptr);                                                                                    \
+        push_off();                                                                                                    \
+        struct slab_magazine *mag = &get_hart_local()->slabs[SLAB_INDEX_##SIZE];                                       \
+        if (SLAB_CHECKS) {                                                                                             \
+            for (uint32_t i = 0; i < mag->count; i++) {                                                                \
+                if (mag->objects[i] == ptr)                                                                            \
+                    PANIC("Double-free of %p (already in hart #%u's magazine)!\n", ptr, get_hart_local()->hartid);     \
+            }                                                                                                          \
+        }                                                                                                              \
+        if (mag->count == SLAB_MAGAZINE_SIZE) {                                                                        \
+            acquire(&root_lock##SIZE);                                                                                 \
+            drain_magazine_##SIZE(mag, SLAB_MAGAZINE_BATCH);                                                           \
+            release(&root_lock##SIZE);                                                                                 \
+        }                                                                                                              \
+        mag->objects[mag->count++] = ptr;                                                                              \
+        pop_off();                                                                                                     \
+    }                                                                                                                  \
+                                                                                                                       \
+    size_t slab_shrink_##SIZE(struct slab_##SIZE *slab, uint32_t keep) {                                               \
+        const bool root = slab == &root_slab##SIZE;                                                                    \
+        if (root && !try_acquire(&root_lock##SIZE))                                                                    \
+            return 0;                                                                                                  \
+        /* The first few are the most recently emptied, and the likeliest to still be in the CPU's caches. */          \
+        struct cache_##SIZE *cache = slab->first_empty;                                                                \
+        for (uint32_t i = 0; cache != NULL && i < keep; i++)                                                           \
+            cache = cache->next_cache;                                                                                 \
+        size_t pages = 0;                                                                                              \
+        while (cache != NULL) {                                                                                        \
+            struct cache_##SIZE *next = cache->next_cache;                                                             \
+            cache_unlink_##SIZE(&slab->first_empty, cache);                                                            \
+            free_pages((paddr_t)cache, PAGES_PER_SLAB);                                                                \
+            pages += PAGES_PER_SLAB;                                                                                   \
+            cache = next;                                                                                              \
+        }                                                                                                              \
+        if (root)                                                                                                      \
+            release(&root_lock##SIZE);                                                                                 \
+        return pages;                                                                                                  \
+    }                                                                                                                  \
     void slab_dbg_##SIZE(struct slab_##SIZE *slab) {                                                                   \
         size_t count = 0, free = 0;                                                                                    \
         const size_t capacity = (PAGE_SIZE * PAGES_PER_SLAB - sizeof(struct cache_##SIZE)) / SIZE,                     \
@@ -167,8 +248,7 @@ void init_root_slabs(void) {
                                                                                                                        \
         for (struct cache_##SIZE *c = slab->first_partial; c != NULL; c = c->next_cache) {                             \
             count++;                                                                                                   \
-            for (struct cache_entry_##SIZE *e = c->first_free; e != NULL; e = e->next)                                 \
-                free++;                                                                                                \
+            free += capacity - c->in_use;                                                                              \
         }                                                                                                              \
                                                                                                                        \
         for (struct cache_##SIZE *c = slab->first_full; c != NULL; c = c->next_cache)                                  \
@@ -194,11 +274,9 @@ void init_root_slabs(void) {
         else {                                                                                                         \
             KDBG("slab" #SIZE, " - Partial caches:\n");                                                                \
             for (struct cache_##SIZE *cache = slab->first_partial; cache != NULL; cache = cache->next_cache) {         \
-                size_t count = 0, capacity = (PAGE_SIZE * PAGES_PER_SLAB - sizeof(struct cache_##SIZE)) / SIZE;        \
-                for (struct cache_entry_##SIZE *e = cache->first_free; e != NULL; e = e->next)                         \
-                    count++;                                                                                           \
                 KDBG("slab" #SIZE, "    - Cache at %p has %d/%d free entries, %d in use (%d.%d%% free).\n", cache,     \
-                     count, capacity, capacity - count, (count * 100) / capacity, ((count * 1000) / capacity) % 10);   \
+                     capacity - cache->in_use, capacity, cache->in_use, ((capacity - cache->in_use) * 100) / capacity, \
+                     (((capacity - cache->in_use) * 1000) / capacity) % 10);                                           \
             }                                                                                                          \
         }                                                                                                              \
         if (slab->first_full == NULL)                                                                                  \
@@ -209,13 +287,21 @@ void init_root_slabs(void) {
                 KDBG("slab" #SIZE, "    - Cache at %p.\n", cache);                                                     \
             }                                                                                                          \
         }                                                                                                              \
+        if (slab != &root_slab##SIZE)                                                                                  \
+            return;                                                                                                    \
+        /* Objects cached in a magazine count as in use above. */                                                      \
+        for (size_t i = 0; i < MAX_HARTS; i++) {                                                                       \
+            const struct slab_magazine *mag = &heart_locals[i].slabs[SLAB_INDEX_##SIZE];                               \
+            if (mag->hits + mag->misses == 0)                                                                          \
+                continue;                                                                                              \
+            KDBG("slab" #SIZE, " - Hart #%zu: %u/%u allocations hit its magazine, %u/%d objects cached.\n", i,         \
+                 mag->hits, mag->hits + mag->misses, mag->count, SLAB_MAGAZINE_SIZE);                                  \
+        }                                                                                                              \
     }
 
-SLAB(4, 1)
-SLAB(8, 1)
-SLAB(16, 1)
-SLAB(32, 1)
-SLAB(64, 1)
+#define X(SIZE, PAGES) SLAB(SIZE, PAGES)
+SLAB_SIZES
+#undef X
 
 #undef SLAB
 
@@ -229,13 +315,250 @@ void *_slab_malloc(size_t size) {
         return slab_alloc(&root_slab16);
     case 17 ... 32:
         return slab_alloc(&root_slab32);
-    case 33 ... 64:
-        return slab_alloc_64(&root_slab64);
+    case 33 ... 48:
+        return slab_alloc(&root_slab48);
+    case 49 ... 64:
+        return slab_alloc(&root_slab64);
+    case 65 ... 96:
+        return slab_alloc(&root_slab96);
+    case 97 ... 128:
+        return slab_alloc(&root_slab128);
+    case 129 ... 192:
+        return slab_alloc(&root_slab192);
+    case 193 ... 256:
+        return slab_alloc(&root_slab256);
+    case 257 ... 384:
+        return slab_alloc(&root_slab384);
+    case 385 ... 512:
+        return slab_alloc(&root_slab512);
+    case 513 ... 768:
+        return slab_alloc(&root_slab768);
+    case 769 ... 1024:
+        return slab_alloc(&root_slab1024);
+    case 1025 ... 1536:
+        return slab_alloc(&root_slab1536);
+    case 1537 ... 2048:
+        return slab_alloc(&root_slab2048);
     default:
         PANIC("No slab allocator of size %lu.\n", size);
     }
 }
 
+void *_kmalloc_large(size_t size) {
+    const size_t pages = align_up(size, PAGE_SIZE) / PAGE_SIZE;
+    const paddr_t paddr = alloc_pages(pages);
+    page_mark_large(paddr, pages);
+    return (void *)paddr;
+}
+
+void *_kmalloc(size_t size) { return size <= MAX_SLAB_SIZE ? _slab_malloc(size) : _kmalloc_large(size); }
+
+void kfree(void *ptr) {
+    if (ptr == NULL)
+        return;
+    const struct page page = page_info(align_down((paddr_t)ptr, PAGE_SIZE));
+    if (page.state == PG_LARGE && is_aligned((paddr_t)ptr, PAGE_SIZE)) {
+        free_pages((paddr_t)ptr, page.pages);
+        return;
+    }
+    if (page.state == PG_SLAB) {
+        switch (page.order) {
+#define X(SIZE, PAGES)                                                                                                 \
+    case SLAB_INDEX_##SIZE:                                                                                            \
+        slab_free(&root_slab##SIZE, ptr);                                                                              \
+        return;
+        SLAB_SIZES
+#undef X
+        }
+    }
+    PANIC("Pointer %p was not allocated by `kmalloc()`!\n", ptr);
+}
+
+// Blocks get at least this many objects, unless that would take more than `KMEM_MAX_PAGES` pages.
+#define KMEM_MIN_OBJECTS 8
+#define KMEM_MAX_PAGES   8
+
+struct kmem_cache *kmem_caches = NULL;
+static struct spinlock kmem_caches_lock = {.name = "KMEM-CACHES", .locked = 0, .hart = 0};
+
+// Where the first of `capacity` objects goes, after the block header and its bitmap.
+static inline size_t kmem_offset(size_t capacity, size_t align) {
+    return align_up(sizeof(struct kmem_block) + ((capacity + 31) / 32) * sizeof(uint32_t), align);
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *)) {
+    if (align < sizeof(void *))
+        align = sizeof(void *);
+    if ((align & (align - 1)) != 0 || align > PAGE_SIZE)
+        PANIC("Cannot align kmem cache `%S` to %zu bytes!\n", name, align);
+    const size_t stride = align_up(size, align);
+
+    size_t pages = 1, capacity;
+    for (;; pages *= 2) {
+        capacity = (pages * PAGE_SIZE) / stride;
+        while (capacity > 0 && kmem_offset(capacity, align) + capacity * stride > pages * PAGE_SIZE)
+            capacity--;
+        if (capacity >= KMEM_MIN_OBJECTS || pages == KMEM_MAX_PAGES)
+            break;
+    }
+    if (capacity == 0)
+        PANIC("Objects of %zu bytes are too large for kmem cache `%S`!\n", size, name);
+
+    struct kmem_cache *cache = slab_malloc(struct kmem_cache);
+    *cache = (struct kmem_cache){.name = name,
+                                 .ctor = ctor,
+                                 .size = stride,
+                                 .align = align,
+                                 .pages = pages,
+                                 .capacity = capacity,
+                                 .offset = kmem_offset(capacity, align),
+                                 .max_empty = SLAB_MAX_EMPTY,
+                                 .lock = {.name = "KMEM-CACHE", .locked = 0, .hart = 0}};
+    acquire(&kmem_caches_lock);
+    cache->next = kmem_caches;
+    kmem_caches = cache;
+    release(&kmem_caches_lock);
+    SLAB_DBG("Created kmem cache `%S`: %zu objects of %zu bytes per %zu-page block.\n", name, capacity, stride, pages);
+    return cache;
+}
+
+static inline void kmem_unlink(struct kmem_block **list, struct kmem_block *block) {
+    if (block->prev_block != NULL)
+        block->prev_block->next_block = block->next_block;
+    else
+        *list = block->next_block;
+    if (block->next_block != NULL)
+        block->next_block->prev_block = block->prev_block;
+    block->next_block = block->prev_block = NULL;
+}
+
+static inline void kmem_push(struct kmem_block **list, struct kmem_block *block) {
+    block->prev_block = NULL;
+    block->next_block = *list;
+    if (*list != NULL)
+        (*list)->prev_block = block;
+    *list = block;
+}
+
+// Carves a new block into constructed objects. Must be called with the cache's lock held.
+static struct kmem_block *kmem_grow(struct kmem_cache *cache) {
+    struct kmem_block *block = (struct kmem_block *)alloc_pages(cache->pages);
+    block->cache = cache;
+    // Slots past the end of the last bitmap word never hold an object, so mark them as taken.
+    for (size_t i = cache->capacity; i < align_up(cache->capacity, 32); i++)
+        block->allocated[i / 32] |= 1u << (i % 32);
+    if (cache->ctor != NULL) {
+        for (size_t i = 0; i < cache->capacity; i++)
+            cache->ctor((void *)block + cache->offset + i * cache->size);
+    }
+    cache->blocks++;
+    return block;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *cache) {
+    acquire(&cache->lock);
+    struct kmem_block *block = cache->first_partial;
+    if (block == NULL) {
+        if (cache->first_empty != NULL) {
+            block = cache->first_empty;
+            kmem_unlink(&cache->first_empty, block);
+        } else {
+            block = kmem_grow(cache);
+        }
+        kmem_push(&cache->first_partial, block);
+    }
+
+    size_t word = block->free_hint;
+    while (block->allocated[word] == (uint32_t)-1)
+        word++;
+    block->free_hint = word;
+    const size_t index = word * 32 + __builtin_ctz(~block->allocated[word]);
+    block->allocated[word] |= 1u << (index % 32);
+    if (++block->in_use == cache->capacity) {
+        kmem_unlink(&cache->first_partial, block);
+        kmem_push(&cache->first_full, block);
+    }
+    cache->allocs++;
+    release(&cache->lock);
+    return (void *)block + cache->offset + index * cache->size;
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *ptr) {
+    struct kmem_block *block = (struct kmem_block *)align_down((paddr_t)ptr, cache->pages * PAGE_SIZE);
+    const paddr_t first = (paddr_t)block + cache->offset;
+    const size_t index = ((paddr_t)ptr - first) / cache->size;
+    if (block->cache != cache || (paddr_t)ptr < first || ((paddr_t)ptr - first) % cache->size != 0 ||
+        index >= cache->capacity)
+        PANIC("Pointer %p was not allocated from kmem cache `%S`!\n", ptr, cache->name);
+
+    acquire(&cache->lock);
+    if ((block->allocated[index / 32] & (1u << (index % 32))) == 0) {
+        release(&cache->lock);
+        PANIC("Double-free of %p!\n", ptr);
+    }
+    block->allocated[index / 32] &= ~(1u << (index % 32));
+    if (index / 32 < block->free_hint)
+        block->free_hint = index / 32;
+    if (block->in_use-- == cache->capacity) {
+        kmem_unlink(&cache->first_full, block);
+        kmem_push(&cache->first_partial, block);
+    }
+    if (block->in_use == 0) {
+        kmem_unlink(&cache->first_partial, block);
+        kmem_push(&cache->first_empty, block);
+    }
+    cache->frees++;
+    release(&cache->lock);
+}
+
+size_t kmem_cache_shrink(struct kmem_cache *cache, uint32_t keep) {
+    if (!try_acquire(&cache->lock))
+        return 0;
+    struct kmem_block *block = cache->first_empty;
+    for (uint32_t i = 0; block != NULL && i < keep; i++)
+        block = block->next_block;
+    size_t pages = 0;
+    while (block != NULL) {
+        struct kmem_block *next = block->next_block;
+        kmem_unlink(&cache->first_empty, block);
+        free_pages((paddr_t)block, cache->pages);
+        cache->blocks--;
+        pages += cache->pages;
+        block = next;
+    }
+    release(&cache->lock);
+    return pages;
+}
+
+size_t slab_shrink_all(bool pressure) {
+    size_t pages = 0;
+#define X(SIZE, PAGES) pages += slab_shrink(&root_slab##SIZE, pressure ? 0 : root_slab##SIZE.max_empty);
+    SLAB_SIZES
+#undef X
+    for (struct kmem_cache *cache = kmem_caches; cache != NULL; cache = cache->next)
+        pages += kmem_cache_shrink(cache, pressure ? 0 : cache->max_empty);
+    if (pages != 0) {
+        SLAB_DBG("Hart #%u returned %zu pages of empty slab caches.\n", get_hart_local()->hartid, pages);
+    }
+    return pages;
+}
+
+static size_t kmem_count(const struct kmem_block *list) {
+    size_t count = 0;
+    for (; list != NULL; list = list->next_block)
+        count++;
+    return count;
+}
+
+void kmem_cache_dbg(struct kmem_cache *cache) {
+    kprintf("kmem cache `%S`: %u-byte objects (%u-byte aligned), %u per %u-page block (%uB waste).\n", cache->name,
+            cache->size, cache->align, cache->capacity, cache->pages,
+            cache->pages * PAGE_SIZE - cache->offset - cache->capacity * cache->size);
+    kprintf(" - %u blocks (%zu empty), %u/%u objects in use, %u allocations and %u frees so far.\n", cache->blocks,
+            kmem_count(cache->first_empty), cache->allocs - cache->frees, cache->blocks * cache->capacity,
+            cache->allocs, cache->frees);
+}
+
 #ifdef TESTS
 
 #define SLAB(SIZE, PAGES_PER_SLAB)                                                                                     \
@@ -304,22 +627,228 @@ void *_slab_malloc(size_t size) {
         printf("[SLAB-TESTS] Freeing last allocated object...\n");                                                     \
         slab_free(&slab, test2);                                                                                       \
         slab_dbg(&slab);                                                                                               \
+    }                                                                                                                  \
+                                                                                                                       \
+    /* Objects of the root slab that are handed out, not counting those cached in any hart's magazine. */              \
+    static size_t root_outstanding_##SIZE(void) {                                                                      \
+        size_t count = 0;                                                                                              \
+        acquire(&root_lock##SIZE);                                                                                     \
+        for (struct cache_##SIZE *c = root_slab##SIZE.first_partial; c != NULL; c = c->next_cache)                     \
+            count += c->in_use;                                                                                        \
+        for (struct cache_##SIZE *c = root_slab##SIZE.first_full; c != NULL; c = c->next_cache)                        \
+            count += c->in_use;                                                                                        \
+        release(&root_lock##SIZE);                                                                                     \
+        for (size_t i = 0; i < MAX_HARTS; i++)                                                                         \
+            count -= heart_locals[i].slabs[SLAB_INDEX_##SIZE].count;                                                   \
+        return count;                                                                                                  \
     }
 
-SLAB(4, 1)
-SLAB(8, 1)
-SLAB(16, 1)
-SLAB(32, 1)
-SLAB(64, 1)
+
+#define X(SIZE, PAGES) SLAB(SIZE, PAGES)
+SLAB_SIZES
+#undef X
 
 #undef SLAB
 
+#define SLAB_BENCH_CACHES 256
+
+// Frees objects from `SLAB_BENCH_CACHES` different caches in turn, so that no two consecutive frees hit the same cache.
+static void slab_bench_free(void) {
+    struct slab_64 slab;
+    create_slab(&slab);
+    const size_t capacity = (PAGE_SIZE - sizeof(struct cache_64)) / 64, count = capacity * SLAB_BENCH_CACHES;
+    const size_t pointer_pages = align_up(count * sizeof(void *), PAGE_SIZE) / PAGE_SIZE;
+    void **objects = (void **)alloc_pages(pointer_pages);
+    for (size_t i = 0; i < count; i++)
+        objects[i] = slab_alloc(&slab);
+
+    const uint32_t start = READ_CSR(time);
+    for (size_t i = 0; i < capacity; i++) {
+        for (size_t cache = 0; cache < SLAB_BENCH_CACHES; cache++)
+            slab_free(&slab, objects[cache * capacity + i]);
+    }
+    const uint32_t ticks = READ_CSR(time) - start;
+    printf("[SLAB-TESTS] Freed %zu objects spread over %d caches in %u ticks (%u ticks per 1000 frees).\n", count,
+           SLAB_BENCH_CACHES, ticks, (uint32_t)(((uint64_t)ticks * 1000) / count));
+
+    // Every cache should be empty again, so hand them all back.
+    const size_t caches = slab_shrink(&slab, 0);
+    if (caches != SLAB_BENCH_CACHES || slab.first_empty != NULL || slab.first_partial != NULL ||
+        slab.first_full != NULL)
+        PANIC("[SLAB-TESTS] Expected %d empty caches, found %zu!\n", SLAB_BENCH_CACHES, caches);
+    free_pages((paddr_t)objects, pointer_pages);
+}
+
+#define SLAB_SMP_ROUNDS  256
+#define SLAB_SMP_OBJECTS 64
+
+// Every round, each hart fills a row with fresh objects, and then frees the row of the hart after it.
+static void *smp_objects[MAX_HARTS][SLAB_SMP_OBJECTS];
+static volatile uint32_t smp_arrived, smp_generation;
+
+static void smp_barrier(void) {
+    const uint32_t generation = __atomic_load_n(&smp_generation, __ATOMIC_ACQUIRE);
+    if (__atomic_add_fetch(&smp_arrived, 1, __ATOMIC_ACQ_REL) == num_harts) {
+        smp_arrived = 0;
+        __atomic_store_n(&smp_generation, generation + 1, __ATOMIC_RELEASE);
+        return;
+    }
+    while (__atomic_load_n(&smp_generation, __ATOMIC_ACQUIRE) == generation)
+        ;
+}
+
+// Cycles through the sizes of small kernel objects.
+static inline size_t smp_object_size(size_t i) {
+    return 1 + (i * 13) % 64;
+}
+
+// Who filled an object in a given round, so that two harts being handed the same object shows up.
+static inline uint8_t smp_tag(uint32_t hartid, size_t round) {
+    return 0x80 | ((hartid % 32) * 4 + round % 4);
+}
+
+static size_t root_outstanding(void) {
+    size_t count = 0;
+#define X(SIZE, PAGES) count += root_outstanding_##SIZE();
+    SLAB_SIZES
+#undef X
+    return count;
+}
+
+void slab_smp_test(bool report) {
+    const uint32_t hartid = get_hart_local()->hartid, next = (hartid + 1) % num_harts;
+    size_t outstanding = 0;
+    smp_barrier();
+    if (report) {
+        outstanding = root_outstanding();
+        printf("[SLAB-TESTS] Stressing the root slabs from %u harts...\n", num_harts);
+    }
+    smp_barrier();
+
+    const uint32_t start = READ_CSR(time);
+    for (size_t round = 0; round < SLAB_SMP_ROUNDS; round++) {
+        for (size_t i = 0; i < SLAB_SMP_OBJECTS; i++) {
+            const size_t size = smp_object_size(round + i);
+            smp_objects[hartid][i] = kmalloc(size);
+            memset(smp_objects[hartid][i], smp_tag(hartid, round), size);
+        }
+        smp_barrier();
+        for (size_t i = 0; i < SLAB_SMP_OBJECTS; i++) {
+            const size_t size = smp_object_size(round + i);
+            const uint8_t *object = smp_objects[next][i];
+            for (size_t b = 0; b < size; b++) {
+                if (object[b] != smp_tag(next, round))
+                    PANIC("[SLAB-TESTS] Object %p from hart #%u was clobbered by another hart!\n", object, next);
+            }
+            kfree(smp_objects[next][i]);
+        }
+        smp_barrier();
+    }
+    const uint32_t ticks = READ_CSR(time) - start;
+    if (!report)
+        return;
+
+    const size_t ops = (size_t)num_harts * SLAB_SMP_ROUNDS * SLAB_SMP_OBJECTS * 2;
+    printf("[SLAB-TESTS] %u harts made %zu allocations and frees in %u ticks (%u ticks per 1000 operations).\n",
+           num_harts, ops, ticks, (uint32_t)(((uint64_t)ticks * 1000) / ops));
+    uint32_t hits = 0, total = 0;
+    for (size_t i = 0; i < MAX_HARTS; i++) {
+        for (size_t s = 0; s < SLAB_SIZE_COUNT; s++) {
+            hits += heart_locals[i].slabs[s].hits;
+            total += heart_locals[i].slabs[s].hits + heart_locals[i].slabs[s].misses;
+        }
+    }
+    const uint32_t permille = total ? ((uint64_t)hits * 1000) / total : 0;
+    printf("[SLAB-TESTS] %u of %u root slab allocations hit a hart's magazine (%u.%u%%).\n", hits, total,
+           permille / 10, permille % 10);
+    if (root_outstanding() != outstanding)
+        PANIC("[SLAB-TESTS] Expected %zu live root slab objects, found %zu!\n", outstanding, root_outstanding());
+}
+
+// Checks that every size lands in the smallest size class that fits, whether it is known at compile time or not.
+static void kmalloc_test(void) {
+#define X(SIZE, PAGES)                                                                                                 \
+    {                                                                                                                  \
+        volatile size_t size = SIZE;                                                                                   \
+        void *constant = kmalloc(SIZE), *runtime = kmalloc(size);                                                      \
+        const struct page a = page_info(align_down((paddr_t)constant, PAGE_SIZE)),                                     \
+                          b = page_info(align_down((paddr_t)runtime, PAGE_SIZE));                                      \
+        if (a.state != PG_SLAB || a.order != SLAB_INDEX_##SIZE || b.state != PG_SLAB || b.order != SLAB_INDEX_##SIZE)  \
+            PANIC("[SLAB-TESTS] kmalloc(%d) did not come from slab_" #SIZE "!\n", SIZE);                               \
+        memset(constant, 0x5a, SIZE);                                                                                  \
+        memset(runtime, 0x3c, SIZE);                                                                                   \
+        kfree(constant);                                                                                               \
+        kfree(runtime);                                                                                                \
+    }
+
+    SLAB_SIZES
+#undef X
+
+    const size_t pages_before = free_page_count();
+    void *large = kmalloc(3 * PAGE_SIZE + 1);
+    const struct page page = page_info((paddr_t)large);
+    if (!is_aligned((paddr_t)large, PAGE_SIZE) || page.state != PG_LARGE || page.pages != 4)
+        PANIC("[SLAB-TESTS] kmalloc(%d) should have taken 4 whole pages!\n", 3 * PAGE_SIZE + 1);
+    kfree(large);
+    if (free_page_count() != pages_before)
+        PANIC("[SLAB-TESTS] Expected %zu free pages after kfree, found %zu!\n", pages_before, free_page_count());
+    printf("[SLAB-TESTS] kmalloc picked the right size class for all %d sizes.\n", SLAB_SIZE_COUNT);
+}
+
+#define KMEM_TEST_MAGIC 0xc0105e1
+
+struct kmem_test {
+    uint32_t magic;
+    char data[20];
+};
+
+static void construct_kmem_test(void *object) { ((struct kmem_test *)object)->magic = KMEM_TEST_MAGIC; }
+
+// Checks that a named cache aligns and constructs its objects, and that freed objects keep their constructed state.
+static void kmem_test(void) {
+    struct kmem_cache *cache =
+        kmem_cache_create("kmem-test", sizeof(struct kmem_test), CACHE_LINE_SIZE, construct_kmem_test);
+    if (cache->size != CACHE_LINE_SIZE)
+        PANIC("[SLAB-TESTS] Expected a %d-byte stride, got %u!\n", CACHE_LINE_SIZE, cache->size);
+
+    // One more than fits in a block, so that the cache has to grow.
+    const size_t count = cache->capacity + 1;
+    const size_t pointer_pages = align_up(count * sizeof(void *), PAGE_SIZE) / PAGE_SIZE;
+    struct kmem_test **objects = (struct kmem_test **)alloc_pages(pointer_pages);
+    for (size_t i = 0; i < count; i++) {
+        objects[i] = kmem_cache_alloc(cache);
+        if (!is_aligned((paddr_t)objects[i], CACHE_LINE_SIZE) || objects[i]->magic != KMEM_TEST_MAGIC)
+            PANIC("[SLAB-TESTS] Object #%zu at %p is unaligned or was not constructed!\n", i, objects[i]);
+        memset(objects[i]->data, (char)i, sizeof(objects[i]->data));
+    }
+    if (cache->blocks != 2 || cache->first_full == NULL || cache->first_partial == NULL)
+        PANIC("[SLAB-TESTS] Expected one full and one partial block, found %u blocks!\n", cache->blocks);
+    for (size_t i = 0; i < count; i++)
+        kmem_cache_free(cache, objects[i]);
+    if (cache->first_full != NULL || cache->first_partial != NULL)
+        PANIC("[SLAB-TESTS] Every block of `%S` should be empty!\n", cache->name);
+
+    // Reuse must not construct the object again, nor clobber it.
+    struct kmem_test *again = kmem_cache_alloc(cache);
+    if (cache->blocks != 2 || again->magic != KMEM_TEST_MAGIC)
+        PANIC("[SLAB-TESTS] Reused object %p lost its constructed state!\n", again);
+    kmem_cache_free(cache, again);
+
+    // Both blocks are empty now, and only one of them should survive a shrink.
+    const size_t pages = kmem_cache_shrink(cache, cache->max_empty);
+    if (pages != cache->pages || cache->blocks != 1)
+        PANIC("[SLAB-TESTS] Shrinking `%S` freed %zu pages, leaving %u blocks!\n", cache->name, pages, cache->blocks);
+    slab_dbg(cache);
+    free_pages((paddr_t)objects, pointer_pages);
+}
+
 void slab_test_suite(void) {
-    slab_test_suite_4();
-    slab_test_suite_8();
-    slab_test_suite_16();
-    slab_test_suite_32();
-    slab_test_suite_64();
+#define X(SIZE, PAGES) slab_test_suite_##SIZE();
+    SLAB_SIZES
+#undef X
+    slab_bench_free();
+    kmalloc_test();
+    kmem_test();
 }
 
 #endif
@@ -0,0 +1,142 @@
+#include <common.h>
+#include <kernel.h>
+#include <memory/page_allocator.h>
+#include <memory/slab_allocator.h>
+#include <memory/vma.h>
+#include <memory_mgmt.h>
+#include <spinlock.h>
+#include <string.h>
+
+#ifdef VMA_DEBUG
+#define VMA_DBG(...) KDBG("VMA-CORE", __VA_ARGS__)
+#else
+#define VMA_DBG(...)
+#endif
+
+// Guards the `frames` of shared areas, so that two processes faulting on the same page don't both fill it.
+static struct spinlock shared_frames_lock = {.name = "VMA-FRAMES", .locked = 0, .hart = 0};
+
+void vma_add(struct vma **head, vaddr_t start, vaddr_t end, uint32_t flags, const void *data, vaddr_t data_start,
+             size_t data_size, paddr_t *frames) {
+    if (!is_aligned(start, PAGE_SIZE) || !is_aligned(end, PAGE_SIZE) || start >= end)
+        PANIC("Bad VMA range %p-%p!\n", start, end);
+
+    struct vma *prev = NULL, **link = head;
+    while (*link != NULL && (*link)->start < start) {
+        prev = *link;
+        link = &prev->next;
+    }
+    if ((*link != NULL && (*link)->start < end) || (prev != NULL && prev->end > start))
+        PANIC("VMA %p-%p overlaps an existing area!\n", start, end);
+
+    struct vma *vma = slab_malloc(struct vma);
+    *vma = (struct vma){.next = *link,
+                        .start = start,
+                        .end = end,
+                        .flags = flags,
+                        .data = data,
+                        .data_start = data_start,
+                        .data_size = data_size,
+                        .frames = frames};
+    *link = vma;
+    VMA_DBG("Added VMA %p-%p (flags %#x, %zu bytes backed from %p).\n", start, end, flags, data_size, data);
+}
+
+void vma_grow(struct vma **head, vaddr_t start, vaddr_t end, uint32_t flags) {
+    struct vma *last = start > 0 ? vma_find(*head, start - 1) : NULL;
+    if (last == NULL || last->end != start || last->flags != flags || last->data != NULL || last->frames != NULL) {
+        vma_add(head, start, end, flags, NULL, 0, 0, NULL);
+        return;
+    }
+    if (!is_aligned(end, PAGE_SIZE) || end <= start || (last->next != NULL && last->next->start < end))
+        PANIC("Can't grow VMA %p-%p to %p!\n", last->start, last->end, end);
+    last->end = end;
+    VMA_DBG("Grew VMA %p-%p to %p.\n", last->start, start, end);
+}
+
+struct vma *vma_find(struct vma *head, vaddr_t vaddr) {
+    for (struct vma *vma = head; vma != NULL && vma->start <= vaddr; vma = vma->next) {
+        if (vaddr < vma->end)
+            return vma;
+    }
+    return NULL;
+}
+
+void vma_free_all(struct vma **head) {
+    struct vma *vma = *head;
+    while (vma != NULL) {
+        struct vma *next = vma->next;
+        kfree(vma);
+        vma = next;
+    }
+    *head = NULL;
+}
+
+void vma_clone(struct vma **dst, const struct vma *src) {
+    if (*dst != NULL)
+        PANIC("Cloning VMAs into a non-empty list!\n");
+    for (; src != NULL; src = src->next) {
+        struct vma *vma = slab_malloc(struct vma);
+        *vma = *src;
+        vma->next = NULL;
+        *dst = vma;
+        dst = &vma->next;
+    }
+}
+
+bool vma_fault(struct vma *head, uint32_t *page_table, vaddr_t vaddr, uint32_t access) {
+    struct vma *vma = vma_find(head, vaddr);
+    if (vma == NULL || (vma->flags & access) != access)
+        return false;
+
+    const vaddr_t page_vaddr = align_down(vaddr, PAGE_SIZE);
+    const uint32_t *pte = walk_page_table(page_table, page_vaddr);
+    if (pte != NULL && (*pte & PAGE_V))
+        return false;
+
+    paddr_t *shared = vma->frames != NULL ? &vma->frames[(page_vaddr - vma->start) / PAGE_SIZE] : NULL;
+    if (shared != NULL) {
+        acquire(&shared_frames_lock);
+        if (*shared != 0) {
+            const paddr_t frame = *shared;
+            if ((vma->flags & PAGE_W) && access == PAGE_W) {
+                // Being written to straight away, so don't bother sharing it first.
+                release(&shared_frames_lock);
+                const paddr_t page = alloc_pages(1);
+                memcpy_s((void *)page, PAGE_SIZE, (const void *)frame, PAGE_SIZE);
+                map_page(page_table, page_vaddr, page, vma->flags | PAGE_U);
+                VMA_DBG("Copied shared page %p to %p at %p.\n", frame, page, page_vaddr);
+                return true;
+            }
+            page_get(frame);
+            release(&shared_frames_lock);
+            const uint32_t flags = (vma->flags & PAGE_W) ? (vma->flags & ~PAGE_W) | PAGE_COW : vma->flags;
+            map_page(page_table, page_vaddr, frame, flags | PAGE_U);
+            VMA_DBG("Mapped shared page %p at %p.\n", frame, page_vaddr);
+            return true;
+        }
+    }
+
+    const paddr_t page = alloc_pages(1);
+    if (vma->data != NULL) {
+        // Copy whatever part of the backing bytes falls within this page.
+        const vaddr_t from = page_vaddr > vma->data_start ? page_vaddr : vma->data_start;
+        const vaddr_t data_end = vma->data_start + vma->data_size;
+        const vaddr_t to = page_vaddr + PAGE_SIZE < data_end ? page_vaddr + PAGE_SIZE : data_end;
+        if (from < to)
+            memcpy_s((void *)(page + (from - page_vaddr)), PAGE_SIZE - (from - page_vaddr),
+                     vma->data + (from - vma->data_start), to - from);
+    }
+    uint32_t flags = vma->flags;
+    if (shared != NULL) {
+        // The area's own reference, dropped by whoever owns `frames`.
+        page_get(page);
+        *shared = page;
+        release(&shared_frames_lock);
+        if (flags & PAGE_W)
+            flags = (flags & ~PAGE_W) | PAGE_COW;
+    }
+    map_page(page_table, page_vaddr, page, flags | PAGE_U);
+    VMA_DBG("Faulted in page %p at %p.\n", page, page_vaddr);
+    return true;
+}
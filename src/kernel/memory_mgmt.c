@@ -1,7 +1,15 @@
 #include <common.h>
+#include <harts.h>
 #include <kernel.h>
 #include <memory/page_allocator.h>
 #include <memory_mgmt.h>
+#include <spinlock.h>
+#include <stdio.h>
+
+// ASIDs are handed out in increasing order; once they run out, a new generation starts and every hart drops its whole
+// TLB before it next switches address spaces. ASID 0 is never handed out.
+static uint32_t asid_max = 0, asid_generation = 1, next_asid = 1;
+static struct spinlock asid_lock = {.name = "ASID", .locked = 0, .hart = 0};
 
 void map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags) {
     if (!is_aligned(vaddr, PAGE_SIZE))
@@ -15,6 +23,8 @@ void map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags) {
         // Create the non-existent 2nd level page table.
         uint32_t pt_paddr = alloc_pages(1);
         table1[vpn1] = ((pt_paddr / PAGE_SIZE) << 10) | PAGE_V;
+    } else if (IS_LEAF(table1[vpn1])) {
+        PANIC("vaddr %x is already mapped by a megapage", vaddr);
     }
 
     // Set the 2nd level page table entry to map the physical page.
@@ -22,3 +32,109 @@ void map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags) {
     uint32_t *table0 = (uint32_t *)((table1[vpn1] >> 10) * PAGE_SIZE);
     table0[vpn0] = ((paddr / PAGE_SIZE) << 10) | flags | PAGE_V;
 }
+
+uint32_t *walk_page_table(uint32_t *table1, uint32_t vaddr) {
+    const uint32_t vpn1 = (vaddr >> 22) & 0x3ff;
+    if ((table1[vpn1] & PAGE_V) == 0 || IS_LEAF(table1[vpn1]))
+        return NULL;
+    uint32_t *table0 = (uint32_t *)((table1[vpn1] >> 10) * PAGE_SIZE);
+    return &table0[(vaddr >> 12) & 0x3ff];
+}
+
+void map_megapage(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags) {
+    if (!is_aligned(vaddr, MEGAPAGE_SIZE))
+        PANIC("unaligned vaddr %x", vaddr);
+
+    if (!is_aligned(paddr, MEGAPAGE_SIZE))
+        PANIC("unaligned paddr %x", paddr);
+
+    uint32_t vpn1 = (vaddr >> 22) & 0x3ff;
+    if (table1[vpn1] & PAGE_V)
+        PANIC("vaddr %x is already mapped", vaddr);
+
+    table1[vpn1] = ((paddr / PAGE_SIZE) << 10) | flags | PAGE_V;
+}
+
+void map_range(uint32_t *table1, uint32_t vaddr, paddr_t paddr, size_t size, uint32_t flags) {
+    if (!is_aligned(vaddr, PAGE_SIZE) || !is_aligned(paddr, PAGE_SIZE) || !is_aligned(size, PAGE_SIZE))
+        PANIC("unaligned range %x->%x (%zu bytes)", vaddr, paddr, size);
+
+    while (size) {
+        const uint32_t vpn1 = (vaddr >> 22) & 0x3ff;
+        if (size >= MEGAPAGE_SIZE && is_aligned(vaddr, MEGAPAGE_SIZE) && is_aligned(paddr, MEGAPAGE_SIZE) &&
+            (table1[vpn1] & PAGE_V) == 0) {
+            map_megapage(table1, vaddr, paddr, flags);
+            vaddr += MEGAPAGE_SIZE;
+            paddr += MEGAPAGE_SIZE;
+            size -= MEGAPAGE_SIZE;
+        } else {
+            map_page(table1, vaddr, paddr, flags);
+            vaddr += PAGE_SIZE;
+            paddr += PAGE_SIZE;
+            size -= PAGE_SIZE;
+        }
+    }
+}
+
+void init_asids(const uint32_t *page_table) {
+    const uint32_t satp = READ_CSR(satp);
+    WRITE_CSR(satp, SATP_SV32 | SATP_ASID_MASK | ((uint32_t)page_table / PAGE_SIZE));
+    asid_max = (READ_CSR(satp) & SATP_ASID_MASK) >> SATP_ASID_SHIFT;
+    WRITE_CSR(satp, satp);
+    SFENCE_VMA_ALL();
+
+    uint32_t bits = 0;
+    while (asid_max >> bits)
+        bits++;
+    kprintf("Hart implements %u ASID bits (%u usable ASIDs per generation).\n", bits, asid_max);
+}
+
+uint32_t activate_address_space(struct asid *asid, const uint32_t *page_table) {
+    const uint32_t ppn = (uint32_t)page_table / PAGE_SIZE;
+    if (asid_max == 0) {
+        // Without ASIDs, nothing in the TLB can be trusted after a switch.
+        SFENCE_VMA_ALL();
+        return SATP_SV32 | ppn;
+    }
+
+    push_off();
+    bool fresh = false;
+    acquire(&asid_lock);
+    if (asid->generation != asid_generation) {
+        if (next_asid > asid_max) {
+            asid_generation++;
+            next_asid = 1;
+            for (size_t i = 0; i < MAX_HARTS; i++)
+                heart_locals[i].tlb_stale = true;
+        }
+        asid->generation = asid_generation;
+        asid->id = next_asid++;
+        fresh = true;
+    }
+    release(&asid_lock);
+
+    hart_local *hart = get_hart_local();
+    if (hart->tlb_stale) {
+        // Our TLB may still hold translations for ASIDs from the previous generation, which are being reused.
+        hart->tlb_stale = false;
+        SFENCE_VMA_ALL();
+    } else if (fresh) {
+        SFENCE_VMA_ASID(asid->id);
+    }
+    pop_off();
+    return SATP_SV32 | ((uint32_t)asid->id << SATP_ASID_SHIFT) | ppn;
+}
+
+void flush_page(const struct asid *asid, uint32_t vaddr) {
+    if (asid_max == 0 || asid->generation != asid_generation)
+        SFENCE_VMA_PAGE(vaddr);
+    else
+        SFENCE_VMA_PAGE_ASID(vaddr, asid->id);
+}
+
+void flush_asid(const struct asid *asid) {
+    if (asid_max == 0 || asid->generation != asid_generation)
+        SFENCE_VMA_ALL();
+    else
+        SFENCE_VMA_ASID(asid->id);
+}
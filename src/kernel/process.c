@@ -1,11 +1,14 @@
+#include <color.h>
 #include <common.h>
 #include <devices/plic.h>
 #include <devices/uart.h>
 #include <devices/virtio.h>
 #include <harts.h>
+#include <io.h>
 #include <kernel.h>
 #include <memory/page_allocator.h>
 #include <memory/slab_allocator.h>
+#include <memory/vma.h>
 #include <memory_mgmt.h>
 #include <process.h>
 #include <spinlock.h>
@@ -220,9 +223,11 @@ bool inspect_elf(paddr_t data) {
 #define PROCESS_DBG(...)
 #endif
 
-extern char __kernel_base[], __free_ram_end[];
+extern char __kernel_base[];
 
 struct process *procs[PROCS_MAX] = {}; // All process control structures.
+// Every hart updates the state of the processes it runs, so they get a cache line (or a few) each.
+static struct kmem_cache *process_cache = NULL;
 
 __attribute__((naked)) void switch_context(uint32_t *prev_sp, uint32_t *next_sp) {
     __asm__ __volatile__("addi sp, sp, -13 * 4\n" // Allocate stack space for 13 4-byte registers
@@ -268,28 +273,386 @@ __attribute__((naked)) void user_entry(void) {
         : [sepc] "r"(USER_BASE), [sstatus] "r"(SSTATUS_SPIE | SSTATUS_SUM), [user_entry] "r"((uint32_t)user_trap));
 }
 
-struct process *create_process_elf(const elf32_header *elf32) {
-    struct process *proc = NULL;
-    int i;
-    for (i = 0; i < PROCS_MAX; i++) {
-        if (procs[i] != NULL && procs[i]->state == PROC_UNUSED) {
-            proc = procs[i];
+// Where a forked child first returns to, from `switch_context`. The child's kernel stack holds a copy of its parent's
+// trap frame, which is restored much like `user_trap` would, resuming user mode at the PC in s0. gp and tp keep their
+// current (kernel) values rather than the parent's.
+__attribute__((naked)) void fork_entry(void) {
+    __asm__ __volatile__("csrw sepc, s0\n"
+                         "li t0, %[sstatus]\n"
+                         "csrw sstatus, t0\n"
+                         "la t0, user_trap\n"
+                         "csrw stvec, t0\n"
+                         "lw ra,  4 * 0(sp)\n"
+                         "lw t0,  4 * 3(sp)\n"
+                         "lw t1,  4 * 4(sp)\n"
+                         "lw t2,  4 * 5(sp)\n"
+                         "lw t3,  4 * 6(sp)\n"
+                         "lw t4,  4 * 7(sp)\n"
+                         "lw t5,  4 * 8(sp)\n"
+                         "lw t6,  4 * 9(sp)\n"
+                         "lw a0,  4 * 10(sp)\n"
+                         "lw a1,  4 * 11(sp)\n"
+                         "lw a2,  4 * 12(sp)\n"
+                         "lw a3,  4 * 13(sp)\n"
+                         "lw a4,  4 * 14(sp)\n"
+                         "lw a5,  4 * 15(sp)\n"
+                         "lw a6,  4 * 16(sp)\n"
+                         "lw a7,  4 * 17(sp)\n"
+                         "lw s0,  4 * 18(sp)\n"
+                         "lw s1,  4 * 19(sp)\n"
+                         "lw s2,  4 * 20(sp)\n"
+                         "lw s3,  4 * 21(sp)\n"
+                         "lw s4,  4 * 22(sp)\n"
+                         "lw s5,  4 * 23(sp)\n"
+                         "lw s6,  4 * 24(sp)\n"
+                         "lw s7,  4 * 25(sp)\n"
+                         "lw s8,  4 * 26(sp)\n"
+                         "lw s9,  4 * 27(sp)\n"
+                         "lw s10, 4 * 28(sp)\n"
+                         "lw s11, 4 * 29(sp)\n"
+                         "lw sp,  4 * 30(sp)\n"
+                         "sret\n"
+                         :
+                         : [sstatus] "i"(SSTATUS_SPIE | SSTATUS_SUM));
+}
+
+// Level-1 entries shared by every address space, and which of them are in use.
+static uint32_t *kernel_page_table = NULL;
+static uint16_t kernel_vpn1s[1024];
+static size_t kernel_vpn1_count = 0;
+
+void init_kernel_page_table(void) {
+    const uint32_t flags = PAGE_R | PAGE_W | PAGE_X | PAGE_G;
+    kernel_page_table = (uint32_t *)alloc_pages(1);
+    // Identity-map all of RAM, which includes every kernel stack, and the MMIO windows the kernel uses.
+    map_range(kernel_page_table, (paddr_t)__kernel_base, (paddr_t)__kernel_base, ram_end - (paddr_t)__kernel_base,
+              flags);
+
+    // Device interrupts are taken in whatever address space is live, so every virtio device's registers are mapped.
+    if (virtio_mmio_end != 0)
+        map_range(kernel_page_table, virtio_mmio_start, virtio_mmio_start, virtio_mmio_end - virtio_mmio_start,
+                  flags & ~PAGE_X);
+    if (plic_base) {
+        paddr_t plic_start = align_down(plic_base, PAGE_SIZE);
+        map_range(kernel_page_table, plic_start, plic_start, align_up(plic_base + 0x0600000, PAGE_SIZE) - plic_start,
+                  flags & ~PAGE_X);
+    }
+    if (uart_base)
+        map_page(kernel_page_table, uart_base, uart_base, flags & ~PAGE_X);
+
+    for (size_t vpn1 = 0; vpn1 < 1024; vpn1++) {
+        if ((kernel_page_table[vpn1] & PAGE_V) == 0)
+            continue;
+        // A global non-leaf entry makes everything beneath it global as well.
+        kernel_page_table[vpn1] |= PAGE_G;
+        kernel_vpn1s[kernel_vpn1_count++] = vpn1;
+    }
+    PROCESS_DBG("Kernel page table at %p uses %zu level-1 entries.\n", kernel_page_table, kernel_vpn1_count);
+    init_asids(kernel_page_table);
+}
+
+// Creates a new level-1 table that shares the kernel's mappings (and level-0 tables).
+static uint32_t *create_page_table(void) {
+    if (kernel_page_table == NULL)
+        PANIC("init_kernel_page_table() has not been called!\n");
+    uint32_t *page_table = (uint32_t *)alloc_pages(1);
+    for (size_t i = 0; i < kernel_vpn1_count; i++)
+        page_table[kernel_vpn1s[i]] = kernel_page_table[kernel_vpn1s[i]];
+    return page_table;
+}
+
+// Images of every ELF that at least one process is running, so that launching it again shares its read-only pages.
+static struct elf_image *elf_images = NULL;
+static struct spinlock elf_images_lock = {.name = "ELF-IMAGES", .locked = 0, .hart = 0};
+
+static inline bool is_load_segment(const elf32_program_header *program) {
+    return program->segment_type == 0x1 && program->p_memsz != 0;
+}
+
+static inline size_t segment_pages(const elf32_program_header *program) {
+    const vaddr_t vaddr = align_down(program->p_vaddr, PAGE_SIZE);
+    return (program->p_memsz + (PAGE_SIZE - 1) + (program->p_vaddr - vaddr)) / PAGE_SIZE;
+}
+
+// The leading pages of a segment that hold bytes from the file. The rest of it is only ever zero-filled.
+static inline size_t segment_file_pages(const elf32_program_header *program) {
+    if (program->p_filesz == 0)
+        return 0;
+    const vaddr_t vaddr = align_down(program->p_vaddr, PAGE_SIZE);
+    return (program->p_filesz + (PAGE_SIZE - 1) + (program->p_vaddr - vaddr)) / PAGE_SIZE;
+}
+
+// Whether any of a segment's pages would land in one of the level-1 entries shared with the kernel.
+static bool segment_overlaps_kernel(const elf32_program_header *program) {
+    const vaddr_t vaddr = align_down(program->p_vaddr, PAGE_SIZE);
+    const uint64_t end = (uint64_t)vaddr + (uint64_t)segment_pages(program) * PAGE_SIZE;
+    if (end > (uint64_t)1 << 32)
+        return true;
+    for (size_t vpn1 = vaddr >> 22; vpn1 <= ((end - 1) >> 22); vpn1++) {
+        if (kernel_page_table[vpn1] & PAGE_V)
+            return true;
+    }
+    return false;
+}
+
+// Only 32-bit little-endian RISC-V executables are run.
+static inline bool is_loadable_elf(const elf32_header *elf) {
+    return elf->elf.magic == 0x7f && elf->elf.elf[0] == 'E' && elf->elf.elf[1] == 'L' && elf->elf.elf[2] == 'F' &&
+           elf->elf.width == 1 && elf->elf.endian && elf->elf.type == 2 && elf->elf.isa == 0xf3 &&
+           elf->program_table_entry_size == sizeof(elf32_program_header) &&
+           sizeof(elf32_header) + elf->program_table_count * sizeof(elf32_program_header) <= PAGE_SIZE;
+}
+
+static inline size_t frame_table_pages(const struct elf_image *image) {
+    return align_up(image->frame_count * sizeof(paddr_t), PAGE_SIZE) / PAGE_SIZE;
+}
+
+static void free_elf_image(struct elf_image *image) {
+    for (size_t i = 0; i < image->frame_count; i++) {
+        if (image->frames[i] != 0)
+            page_put(image->frames[i]);
+    }
+    if (image->frames != NULL)
+        free_pages((paddr_t)image->frames, frame_table_pages(image));
+    free_pages((paddr_t)image->elf, 1);
+    kfree(image);
+}
+
+// Reads `file`'s headers, then the file-backed part of each loadable segment straight into the pages it will be mapped
+// from.
+static struct elf_image *read_elf_image(struct file *file) {
+    struct filesystem *fs = file->super.filesystem;
+    elf32_header *elf = (elf32_header *)alloc_pages(1);
+    if (fs->read_file_at(fs, file, elf, 0, sizeof(elf32_header)) != sizeof(elf32_header) || !is_loadable_elf(elf)) {
+        kprintf(ANSI_RED "`%S` is not an ELF file we can load!\n", *file->super.name);
+        free_pages((paddr_t)elf, 1);
+        return NULL;
+    }
+    // Keep the program headers right behind the ELF header.
+    const size_t table_size = elf->program_table_count * sizeof(elf32_program_header);
+    if (fs->read_file_at(fs, file, elf + 1, elf->program_table_offset, table_size) != table_size) {
+        kprintf(ANSI_RED "Could not read the program headers of `%S`!\n", *file->super.name);
+        free_pages((paddr_t)elf, 1);
+        return NULL;
+    }
+    elf->program_table_offset = sizeof(elf32_header);
+
+    const elf32_program_header *program = (elf32_program_header *)(elf + 1);
+    size_t frame_count = 0;
+    for (size_t i = 0; i < elf->program_table_count; i++) {
+        if (!is_load_segment(&program[i]))
+            continue;
+        if (program[i].p_filesz > program[i].p_memsz) {
+            kprintf(ANSI_RED "Segment #%zu of `%S` is larger in the file than in memory!\n", i, *file->super.name);
+            free_pages((paddr_t)elf, 1);
+            return NULL;
+        }
+        // User pages must not end up in one of the level-0 tables shared with the kernel.
+        if (segment_overlaps_kernel(&program[i])) {
+            kprintf(ANSI_RED "Segment #%zu of `%S` at %p overlaps the kernel's mappings!\n", i, *file->super.name,
+                    program[i].p_vaddr);
+            free_pages((paddr_t)elf, 1);
+            return NULL;
+        }
+        frame_count += segment_file_pages(&program[i]);
+    }
+
+    struct elf_image *image = slab_malloc(struct elf_image);
+    *image = (struct elf_image){.file = file, .elf = elf, .frame_count = frame_count};
+    if (image->frame_count != 0)
+        image->frames = (paddr_t *)alloc_pages(frame_table_pages(image));
+
+    paddr_t *frames = image->frames;
+    for (size_t i = 0; i < elf->program_table_count; i++) {
+        if (!is_load_segment(&program[i]))
+            continue;
+        // Pages come zeroed, which takes care of whatever the file's bytes don't cover in the first and last of them.
+        const size_t pages = segment_file_pages(&program[i]);
+        if (pages == 0)
+            continue;
+        const paddr_t base = alloc_pages(pages);
+        for (size_t page = 0; page < pages; page++)
+            *frames++ = base + page * PAGE_SIZE;
+        void *dest = (void *)(base + (program[i].p_vaddr - align_down(program[i].p_vaddr, PAGE_SIZE)));
+        if (fs->read_file_at(fs, file, dest, program[i].p_offset, program[i].p_filesz) != program[i].p_filesz) {
+            kprintf(ANSI_RED "Could not read segment #%zu of `%S`!\n", i, *file->super.name);
+            free_elf_image(image);
+            return NULL;
+        }
+        PROCESS_DBG("Read segment #%zu of `%S`: %zu pages, %lu bytes from the file.\n", i, *file->super.name, pages,
+                    program[i].p_filesz);
+    }
+    return image;
+}
+
+// Returns the image of `file` already in `elf_images`, if any. Must hold `elf_images_lock`.
+static struct elf_image *find_elf_image(const struct file *file) {
+    for (struct elf_image *image = elf_images; image != NULL; image = image->next) {
+        if (image->file == file)
+            return image;
+    }
+    return NULL;
+}
+
+struct elf_image *load_elf_image(struct file *file) {
+    acquire(&elf_images_lock);
+    struct elf_image *image = find_elf_image(file);
+    if (image != NULL) {
+        image->refs++;
+        release(&elf_images_lock);
+        PROCESS_DBG("Reusing the loaded image of `%S`.\n", *file->super.name);
+        return image;
+    }
+    release(&elf_images_lock);
+
+    struct elf_image *loaded = read_elf_image(file);
+    if (loaded == NULL)
+        return NULL;
+    acquire(&elf_images_lock);
+    // Another hart may have read the same file in the meantime; keep whichever image made it into the list first.
+    image = find_elf_image(file);
+    if (image == NULL) {
+        image = loaded;
+        loaded = NULL;
+        image->next = elf_images;
+        elf_images = image;
+    }
+    image->refs++;
+    release(&elf_images_lock);
+    if (loaded != NULL)
+        free_elf_image(loaded);
+    return image;
+}
+
+void put_elf_image(struct elf_image *image) {
+    if (image == NULL)
+        return;
+    acquire(&elf_images_lock);
+    if (--image->refs) {
+        release(&elf_images_lock);
+        return;
+    }
+    for (struct elf_image **link = &elf_images; *link != NULL; link = &(*link)->next) {
+        if (*link == image) {
+            *link = image->next;
             break;
         }
     }
+    release(&elf_images_lock);
+    free_elf_image(image);
+}
+
+// Frees a page table, its level-0 tables, and the user pages mapped through it.
+static void free_page_table(uint32_t *table1) {
+    for (size_t vpn1 = 0; vpn1 < 1024; vpn1++) {
+        // Megapages are only ever used for the kernel's identity mappings, and its level-0 tables are shared.
+        if ((table1[vpn1] & PAGE_V) == 0 || IS_LEAF(table1[vpn1]) ||
+            (kernel_page_table != NULL && table1[vpn1] == kernel_page_table[vpn1]))
+            continue;
+        uint32_t *table0 = (uint32_t *)((table1[vpn1] >> 10) * PAGE_SIZE);
+        for (size_t vpn0 = 0; vpn0 < 1024; vpn0++) {
+            // Only user pages belong to the process, everything else is an identity mapping.
+            if ((table0[vpn0] & (PAGE_V | PAGE_U)) == (PAGE_V | PAGE_U))
+                page_put((table0[vpn0] >> 10) * PAGE_SIZE);
+        }
+        free_pages((paddr_t)table0, 1);
+    }
+    free_pages((paddr_t)table1, 1);
+}
+
+// Creates a page table for a child of `parent`, sharing every user page between the two. Writable pages become
+// read-only copy-on-write pages in both, so only the level-0 tables are actually copied here.
+static uint32_t *clone_page_table(struct process *parent) {
+    uint32_t *table1 = create_page_table();
+    uint32_t *parent1 = parent->page_table;
+    for (size_t vpn1 = 0; vpn1 < 1024; vpn1++) {
+        if ((parent1[vpn1] & PAGE_V) == 0 || IS_LEAF(parent1[vpn1]) || parent1[vpn1] == kernel_page_table[vpn1])
+            continue;
+        uint32_t *parent0 = (uint32_t *)((parent1[vpn1] >> 10) * PAGE_SIZE);
+        uint32_t *table0 = (uint32_t *)alloc_pages(1);
+        for (size_t vpn0 = 0; vpn0 < 1024; vpn0++) {
+            uint32_t pte = parent0[vpn0];
+            if ((pte & (PAGE_V | PAGE_U)) != (PAGE_V | PAGE_U))
+                continue;
+            if (pte & PAGE_W)
+                parent0[vpn0] = pte = (pte & ~PAGE_W) | PAGE_COW;
+            page_get((pte >> 10) * PAGE_SIZE);
+            table0[vpn0] = pte;
+        }
+        table1[vpn1] = (((paddr_t)table0 / PAGE_SIZE) << 10) | PAGE_V;
+    }
+    // The parent may still have writable translations cached.
+    flush_asid(&parent->asid);
+    return table1;
+}
+
+// Gives the faulting process a private, writable copy of the copy-on-write page behind `pte`.
+static void break_cow(uint32_t *pte) {
+    const paddr_t shared = (*pte >> 10) * PAGE_SIZE;
+    const uint32_t flags = (*pte & 0x3ff & ~PAGE_COW) | PAGE_W;
+    if (!page_shared(shared)) {
+        // Everyone else has already taken their own copy (or exited), so this one can be written in place.
+        *pte = (*pte & ~0x3ff) | flags;
+        return;
+    }
+    const paddr_t copy = alloc_pages(1);
+    memcpy_s((void *)copy, PAGE_SIZE, (const void *)shared, PAGE_SIZE);
+    *pte = ((copy / PAGE_SIZE) << 10) | flags;
+    page_put(shared);
+}
+
+// Returns everything an exited process owned (kernel stack, user pages and page tables) to the page allocator.
+static void reap_process(struct process *proc) {
+    PROCESS_DBG("Reaping process %hd.\n", proc->pid);
+    free_page_table(proc->page_table);
+    free_pages((paddr_t)proc->stack, PAGES_PER_STACK);
+    vma_free_all(&proc->vmas);
+    put_elf_image(proc->image);
+    proc->image = NULL;
+    proc->page_table = NULL;
+    proc->stack = NULL;
+    proc->state = PROC_UNUSED;
+}
+
+// Process control structures start out unused, with nothing to reap.
+static void construct_process(void *object) {
+    struct process *proc = object;
+    proc->page_table = NULL;
+    proc->stack = NULL;
+    proc->vmas = NULL;
+    proc->image = NULL;
+    proc->state = PROC_UNUSED;
+}
+
+void init_processes(void) {
+    process_cache = kmem_cache_create("process", sizeof(struct process), CACHE_LINE_SIZE, construct_process);
+}
+
+// Finds (or creates) an unused process control structure, reaping it first if its previous owner has exited.
+static struct process *alloc_process(int *slot) {
+    for (int i = 0; i < PROCS_MAX; i++) {
+        if (procs[i] != NULL && (procs[i]->state == PROC_UNUSED || procs[i]->state == PROC_EXITED)) {
+            if (procs[i]->state == PROC_EXITED)
+                reap_process(procs[i]);
+            *slot = i;
+            return procs[i];
+        }
+    }
 
-    if (proc == NULL) {
-        for (i = 0; i < PROCS_MAX; i++) {
-            if (procs[i] == NULL) {
-                // proc = procs[i] = (struct process*)slab_alloc(&root_slab32);
-                proc = procs[i] = slab_malloc(struct process);
-                break;
-            }
+    for (int i = 0; i < PROCS_MAX; i++) {
+        if (procs[i] == NULL) {
+            *slot = i;
+            return procs[i] = kmem_cache_alloc(process_cache);
         }
     }
 
-    if (!proc)
-        PANIC("no free process slots");
+    PANIC("no free process slots");
+}
+
+struct process *create_process_elf(struct elf_image *image) {
+    const elf32_header *elf32 = image->elf;
+    int i;
+    struct process *proc = alloc_process(&i);
 
     proc->stack = (uint8_t (*)[STACK_SIZE])alloc_pages(PAGES_PER_STACK);
 
@@ -310,63 +673,43 @@ struct process *create_process_elf(const elf32_header *elf32) {
     *--sp = 0;                    // s0
     *--sp = (uint32_t)user_entry; // ra
 
-    uint32_t *page_table = (uint32_t *)alloc_pages(1);
-    for (paddr_t paddr = (paddr_t)__kernel_base; paddr < (paddr_t)__free_ram_end; paddr += PAGE_SIZE)
-        map_page(page_table, paddr, paddr, PAGE_R | PAGE_W | PAGE_X);
-
-    // Map stack
-    for (paddr_t paddr = (paddr_t)proc->stack; paddr < (paddr_t) & ((*proc->stack)[STACK_SIZE]); paddr += PAGE_SIZE)
-        map_page(page_table, paddr, paddr, PAGE_R | PAGE_W | PAGE_X);
-
-    // Map virtio
-    map_page(page_table, 0x10001000, 0x10001000, PAGE_R | PAGE_W);
-    map_page(page_table, plic_base, plic_base, PAGE_R | PAGE_W);
-    paddr_t plic_start = align_down(plic_base, PAGE_SIZE);
-    paddr_t plic_end = plic_base + 0x0600000;
-    int plic_pages = (plic_end - plic_start) / PAGE_SIZE;
-
-    for (int i = 0; i < plic_pages; i++) {
-        paddr_t plic = plic_start + i * PAGE_SIZE;
-        map_page(page_table, plic, plic, PAGE_R | PAGE_W);
-    }
-    map_page(page_table, uart_base, uart_base, PAGE_R | PAGE_W);
+    uint32_t *page_table = create_page_table();
+    proc->vmas = NULL;
 
     elf32_program_header *program = (elf32_program_header *)((paddr_t)elf32 + elf32->program_table_offset);
+    paddr_t *frames = image->frames;
     for (size_t i = 0; i < elf32->program_table_count; i++) {
-        if (program[i].segment_type != 0x1)
+        if (!is_load_segment(&program[i]))
             continue;
 
-        paddr_t vaddr = align_down(program[i].p_vaddr, PAGE_SIZE);
-        size_t sdiff = program[i].p_vaddr - vaddr;
-        size_t pages = (program[i].p_memsz + (PAGE_SIZE - 1) + sdiff) / PAGE_SIZE;
-
-        PROCESS_DBG("Allocating %zu pages (%lu bytes) at %p for %lu-byte segment #%zu (copying %lu bytes from disk), "
-                    "which is offset by %zu bytes.\n",
-                    pages, pages * PAGE_SIZE, vaddr, program[i].p_memsz, i, program[i].p_filesz, sdiff);
-        paddr_t allocation = alloc_pages(pages);
-        memcpy_s((void *)(allocation + sdiff), pages * PAGE_SIZE, (void *)((paddr_t)elf32) + program[i].p_offset,
-                 program[i].p_filesz);
-        size_t diff = program[i].p_memsz - program[i].p_filesz;
-        if (diff) {
-            PROCESS_DBG("\tZeroing remaining %zu bytes...\n", diff);
-            memset_s((void *)(allocation + program[i].p_filesz + sdiff), diff, 0, diff);
-        }
-        uint32_t flags = PAGE_U;
+        vaddr_t vaddr = align_down(program[i].p_vaddr, PAGE_SIZE);
+        // `read_elf_image()` already made sure none of this overlaps the kernel.
+        size_t pages = segment_pages(&program[i]);
+
+        uint32_t flags = 0;
         if (program[i].flags & 1)
             flags |= PAGE_X;
         if (program[i].flags & 2)
             flags |= PAGE_W;
         if (program[i].flags & 4)
             flags |= PAGE_R;
-        for (size_t page = 0; page < pages; page++) {
-            map_page(page_table, vaddr, allocation, flags);
-            vaddr += PAGE_SIZE;
-            allocation += PAGE_SIZE;
-        }
+        // File-backed pages are mapped from the image on first touch: shared as-is if read-only, copy-on-write if
+        // writable. Whatever is left of the segment (e.g. `.bss`) gets fresh zeroed pages, like the heap.
+        const size_t file_pages = segment_file_pages(&program[i]);
+        PROCESS_DBG("Segment #%zu: %zu pages at %p, %zu of them from the file.\n", i, pages, vaddr, file_pages);
+        if (file_pages != 0)
+            vma_add(&proc->vmas, vaddr, vaddr + file_pages * PAGE_SIZE, flags, NULL, 0, 0, frames);
+        if (file_pages != pages)
+            vma_add(&proc->vmas, vaddr + file_pages * PAGE_SIZE, vaddr + pages * PAGE_SIZE, flags, NULL, 0, 0, NULL);
+        frames += file_pages;
     }
 
     // Initialize fields.
     proc->pid = i - 1;
+    proc->asid = (struct asid){};
+    proc->image = image;
+    proc->brk = USER_HEAP_BASE;
+    proc->heap_end = USER_HEAP_BASE;
     proc->state = PROC_RUNNING;
     proc->sp = (uint32_t)sp;
     proc->page_table = page_table;
@@ -375,27 +718,8 @@ struct process *create_process_elf(const elf32_header *elf32) {
 
 struct process *create_process(const void *image, size_t image_size) {
     // Find an unused process control structure.
-    struct process *proc = NULL;
     int i;
-    for (i = 0; i < PROCS_MAX; i++) {
-        if (procs[i] != NULL && procs[i]->state == PROC_UNUSED) {
-            proc = procs[i];
-            break;
-        }
-    }
-
-    if (proc == NULL) {
-        for (i = 0; i < PROCS_MAX; i++) {
-            if (procs[i] == NULL) {
-                // proc = procs[i] = (struct process*)slab_alloc(&root_slab32);
-                proc = procs[i] = slab_malloc(struct process);
-                break;
-            }
-        }
-    }
-
-    if (!proc)
-        PANIC("no free process slots");
+    struct process *proc = alloc_process(&i);
 
     proc->stack = (uint8_t (*)[STACK_SIZE])alloc_pages(PAGES_PER_STACK);
 
@@ -416,26 +740,7 @@ struct process *create_process(const void *image, size_t image_size) {
     *--sp = 0;                    // s0
     *--sp = (uint32_t)user_entry; // ra
 
-    uint32_t *page_table = (uint32_t *)alloc_pages(1);
-    for (paddr_t paddr = (paddr_t)__kernel_base; paddr < (paddr_t)__free_ram_end; paddr += PAGE_SIZE)
-        map_page(page_table, paddr, paddr, PAGE_R | PAGE_W | PAGE_X);
-
-    // Map stack
-    for (paddr_t paddr = (paddr_t)proc->stack; paddr < (paddr_t) & ((*proc->stack)[STACK_SIZE]); paddr += PAGE_SIZE)
-        map_page(page_table, paddr, paddr, PAGE_R | PAGE_W | PAGE_X);
-
-    // Map virtio
-    map_page(page_table, 0x10001000, 0x10001000, PAGE_R | PAGE_W);
-    map_page(page_table, plic_base, plic_base, PAGE_R | PAGE_W);
-    paddr_t plic_start = align_down(plic_base, PAGE_SIZE);
-    paddr_t plic_end = plic_base + 0x0600000;
-    int plic_pages = (plic_end - plic_start) / PAGE_SIZE;
-
-    for (int i = 0; i < plic_pages; i++) {
-        paddr_t plic = plic_start + i * PAGE_SIZE;
-        map_page(page_table, plic, plic, PAGE_R | PAGE_W);
-    }
-    map_page(page_table, uart_base, uart_base, PAGE_R | PAGE_W);
+    uint32_t *page_table = create_page_table();
 
     // Map user pages.
     for (uint32_t off = 0; off < image_size; off += PAGE_SIZE) {
@@ -453,12 +758,98 @@ struct process *create_process(const void *image, size_t image_size) {
 
     // Initialize fields.
     proc->pid = i - 1;
+    proc->asid = (struct asid){};
+    proc->vmas = NULL;
+    proc->image = NULL;
+    proc->brk = USER_HEAP_BASE;
+    proc->heap_end = USER_HEAP_BASE;
     proc->state = PROC_RUNNING;
     proc->sp = (uint32_t)sp;
     proc->page_table = page_table;
     return proc;
 }
 
+struct process *fork_process(struct process *parent, const struct trap_frame *frame, uint32_t user_pc) {
+    int i;
+    struct process *proc = alloc_process(&i);
+
+    proc->stack = (uint8_t (*)[STACK_SIZE])alloc_pages(PAGES_PER_STACK);
+
+    // Copy the parent's trap frame to the top of the child's kernel stack, where `fork_entry` expects it, with `fork`
+    // returning 0 in the child. Below it go the callee-saved registers for the first switch_context.
+    uint32_t *sp = (uint32_t *)&((*proc->stack)[STACK_SIZE - sizeof(struct trap_frame)]);
+    struct trap_frame *child_frame = (struct trap_frame *)sp;
+    *child_frame = *frame;
+    child_frame->a0 = 0;
+    *--sp = 0;                    // s11
+    *--sp = 0;                    // s10
+    *--sp = 0;                    // s9
+    *--sp = 0;                    // s8
+    *--sp = 0;                    // s7
+    *--sp = 0;                    // s6
+    *--sp = 0;                    // s5
+    *--sp = 0;                    // s4
+    *--sp = 0;                    // s3
+    *--sp = 0;                    // s2
+    *--sp = 0;                    // s1
+    *--sp = user_pc;              // s0
+    *--sp = (uint32_t)fork_entry; // ra
+
+    // Initialize fields.
+    proc->pid = i - 1;
+    proc->asid = (struct asid){};
+    proc->page_table = clone_page_table(parent);
+    proc->vmas = NULL;
+    vma_clone(&proc->vmas, parent->vmas);
+    proc->image = parent->image;
+    proc->brk = parent->brk;
+    proc->heap_end = parent->heap_end;
+    if (proc->image != NULL) {
+        acquire(&elf_images_lock);
+        proc->image->refs++;
+        release(&elf_images_lock);
+    }
+    proc->state = PROC_RUNNING;
+    proc->sp = (uint32_t)sp;
+    PROCESS_DBG("Forked process %hd from %hd.\n", proc->pid, parent->pid);
+    return proc;
+}
+
+bool handle_page_fault(struct process *proc, vaddr_t vaddr, uint32_t scause) {
+    uint32_t access = PAGE_R;
+    if (scause == SCAUSE_INSTRUCTION_PAGE_FAULT)
+        access = PAGE_X;
+    else if (scause == SCAUSE_STORE_PAGE_FAULT)
+        access = PAGE_W;
+
+    uint32_t *pte = walk_page_table(proc->page_table, align_down(vaddr, PAGE_SIZE));
+    if (access == PAGE_W && pte != NULL && (*pte & (PAGE_V | PAGE_U | PAGE_COW)) == (PAGE_V | PAGE_U | PAGE_COW))
+        break_cow(pte);
+    else if (!vma_fault(proc->vmas, proc->page_table, vaddr, access))
+        return false;
+    flush_page(&proc->asid, align_down(vaddr, PAGE_SIZE));
+    return true;
+}
+
+vaddr_t process_sbrk(struct process *proc, int32_t increment) {
+    const vaddr_t old_brk = proc->brk;
+    const uint32_t room = increment < 0 ? old_brk - USER_HEAP_BASE : USER_HEAP_END - old_brk;
+    if ((increment < 0 ? -(uint32_t)increment : (uint32_t)increment) > room)
+        return (vaddr_t)-1;
+    const vaddr_t new_brk = old_brk + increment;
+
+    // Only ever grows the heap area, past wherever an earlier break left it; it's demand-paged, so this costs nothing
+    // until the pages are touched.
+    const vaddr_t wanted = align_up(new_brk, PAGE_SIZE);
+    if (wanted > proc->heap_end) {
+        vma_grow(&proc->vmas, proc->heap_end, wanted, PAGE_R | PAGE_W);
+        proc->heap_end = wanted;
+    }
+    PROCESS_DBG("Process %hd moved its break from %p to %p.\n", proc->pid, old_brk, new_brk);
+    proc->brk = new_brk;
+    return old_brk;
+}
+
 void kyield(void) {
     // Search for a runnable process
     hart_local *hl = get_hart_local();
@@ -484,16 +875,13 @@ void kyield(void) {
     struct process *prev = current_proc;
     set_current_proc(next);
 
-    // Switch page table.
-    __asm__ __volatile__(
-        "sfence.vma\n"
-        "csrw satp, %[satp]\n"
-        "sfence.vma\n"
-        "csrw sscratch, %[sscratch]\n"
-        :
-        // Don't forget the trailing comma!
-        : [satp] "r"(SATP_SV32 | ((uint32_t)next->page_table / PAGE_SIZE)), [sscratch] "r"((uint32_t)&(
-                                                                                (*next->stack)[STACK_SIZE])));
+    // Switch page table. Kernel mappings are global and every process has its own ASID, so no flush is needed here.
+    __asm__ __volatile__("csrw satp, %[satp]\n"
+                         "csrw sscratch, %[sscratch]\n"
+                         :
+                         // Don't forget the trailing comma!
+                         : [satp] "r"(activate_address_space(&next->asid, next->page_table)),
+                           [sscratch] "r"((uint32_t)&((*next->stack)[STACK_SIZE])));
 
     switch_context(&prev->sp, &next->sp);
 }
@@ -531,3 +919,110 @@ void yield(void) { kyield(); }
 
 //     release(&proc->lock);
 // }
+
+#ifdef TESTS
+
+#define PROCESS_TEST_ROUNDS 16
+
+void process_test_suite(void) {
+    /* Identity-mapping the kernel one 4KiB page at a time (the old way) versus with megapages. */
+    size_t free_before = free_page_count();
+    uint32_t *table = (uint32_t *)alloc_pages(1);
+    uint32_t start = READ_CSR(time);
+    for (paddr_t paddr = (paddr_t)__kernel_base; paddr < ram_end; paddr += PAGE_SIZE)
+        map_page(table, paddr, paddr, PAGE_R | PAGE_W | PAGE_X);
+    const uint32_t page_ticks = READ_CSR(time) - start;
+    const size_t page_tables = free_before - free_page_count();
+    free_page_table(table);
+
+    free_before = free_page_count();
+    table = (uint32_t *)alloc_pages(1);
+    start = READ_CSR(time);
+    map_range(table, (paddr_t)__kernel_base, (paddr_t)__kernel_base, ram_end - (paddr_t)__kernel_base,
+              PAGE_R | PAGE_W | PAGE_X);
+    const uint32_t range_ticks = READ_CSR(time) - start;
+    const size_t range_tables = free_before - free_page_count();
+    free_page_table(table);
+
+    printf("[PROCESS-TESTS] Identity-mapping %zuKiB: %u ticks and %zu page-table pages with 4KiB pages, %u ticks and "
+           "%zu page-table pages with megapages (%ux faster).\n",
+           (ram_end - (paddr_t)__kernel_base) / 1024, page_ticks, page_tables, range_ticks, range_tables,
+           page_ticks / (range_ticks ? range_ticks : 1));
+
+    /* Whole process creation, reaping the previous process each time around. The first two may need to grow the
+     * slab that process control structures live in, so they aren't counted. */
+    struct process *proc = create_process(NULL, 0);
+    reap_process(create_process(NULL, 0));
+    reap_process(proc);
+    free_before = free_page_count();
+    start = READ_CSR(time);
+    for (size_t i = 0; i < PROCESS_TEST_ROUNDS; i++) {
+        proc = create_process(NULL, 0);
+        proc->state = PROC_EXITED;
+    }
+    const uint32_t ticks = READ_CSR(time) - start;
+    const size_t used = free_before - free_page_count();
+    reap_process(proc);
+    printf("[PROCESS-TESTS] Created %d processes in %u ticks (%u ticks each), each using %zu pages.\n",
+           PROCESS_TEST_ROUNDS, ticks, ticks / PROCESS_TEST_ROUNDS, used);
+
+    if (free_page_count() != free_before)
+        PANIC("[PROCESS-TESTS] Leaked %zu pages creating and reaping processes!\n", free_before - free_page_count());
+
+    /* Forking only copies page tables; the user pages are shared until written. */
+    free_before = free_page_count();
+    struct process *parent = create_process(__kernel_base, PROCESS_TEST_ROUNDS * PAGE_SIZE);
+    const struct trap_frame frame = {};
+    const size_t parent_used = free_before - free_page_count();
+    start = READ_CSR(time);
+    struct process *child = fork_process(parent, &frame, USER_BASE);
+    const uint32_t fork_ticks = READ_CSR(time) - start;
+    const size_t child_used = free_before - free_page_count() - parent_used;
+    uint32_t *pte = walk_page_table(child->page_table, USER_BASE);
+    if (pte == NULL || (*pte & (PAGE_W | PAGE_COW)) != PAGE_COW || !page_shared((*pte >> 10) * PAGE_SIZE))
+        PANIC("[PROCESS-TESTS] Forked page is not shared copy-on-write!\n");
+    if (!handle_page_fault(child, USER_BASE, SCAUSE_STORE_PAGE_FAULT) || (*pte & (PAGE_W | PAGE_COW)) != PAGE_W ||
+        page_shared((*pte >> 10) * PAGE_SIZE))
+        PANIC("[PROCESS-TESTS] Writing a copy-on-write page did not copy it!\n");
+    printf("[PROCESS-TESTS] Forked a process with %d user pages in %u ticks, using %zu pages (the parent used %zu).\n",
+           PROCESS_TEST_ROUNDS, fork_ticks, child_used, parent_used);
+    reap_process(parent);
+    reap_process(child);
+    if (free_page_count() != free_before)
+        PANIC("[PROCESS-TESTS] Leaked %zu pages forking processes!\n", free_before - free_page_count());
+
+    /* The heap grows as a single area, and only takes pages once they're touched. */
+    proc = create_process(NULL, 0);
+    if (process_sbrk(proc, 3 * PAGE_SIZE) != USER_HEAP_BASE ||
+        process_sbrk(proc, 1) != USER_HEAP_BASE + 3 * PAGE_SIZE ||
+        process_sbrk(proc, 0) != USER_HEAP_BASE + 3 * PAGE_SIZE + 1)
+        PANIC("[PROCESS-TESTS] Growing the heap returned the wrong break!\n");
+    if (process_sbrk(proc, -(int32_t)(4 * PAGE_SIZE)) != (vaddr_t)-1 ||
+        process_sbrk(proc, USER_HEAP_END - USER_HEAP_BASE) != (vaddr_t)-1)
+        PANIC("[PROCESS-TESTS] Moved the break outside of the heap!\n");
+    const struct vma *heap = vma_find(proc->vmas, USER_HEAP_BASE);
+    if (heap == NULL || heap->next != NULL || heap->end != USER_HEAP_BASE + 4 * PAGE_SIZE)
+        PANIC("[PROCESS-TESTS] Growing the heap didn't grow a single area!\n");
+    free_before = free_page_count();
+    if (!handle_page_fault(proc, USER_HEAP_BASE + 3 * PAGE_SIZE, SCAUSE_STORE_PAGE_FAULT) ||
+        handle_page_fault(proc, USER_HEAP_BASE + 4 * PAGE_SIZE, SCAUSE_LOAD_PAGE_FAULT))
+        PANIC("[PROCESS-TESTS] Faulted in the wrong heap pages!\n");
+    printf("[PROCESS-TESTS] Grew the heap to %zu pages, touching one used %zu pages.\n",
+           (align_up(proc->brk, PAGE_SIZE) - USER_HEAP_BASE) / PAGE_SIZE, free_before - free_page_count());
+    reap_process(proc);
+
+    /* Shrinking the heap keeps its area, so growing it again only extends the area past its old end. */
+    proc = create_process(NULL, 0);
+    if (process_sbrk(proc, 4 * PAGE_SIZE) != USER_HEAP_BASE ||
+        process_sbrk(proc, -(int32_t)(2 * PAGE_SIZE)) != USER_HEAP_BASE + 4 * PAGE_SIZE ||
+        process_sbrk(proc, PAGE_SIZE) != USER_HEAP_BASE + 2 * PAGE_SIZE ||
+        process_sbrk(proc, 3 * PAGE_SIZE) != USER_HEAP_BASE + 3 * PAGE_SIZE)
+        PANIC("[PROCESS-TESTS] Regrowing the heap returned the wrong break!\n");
+    heap = vma_find(proc->vmas, USER_HEAP_BASE);
+    if (heap == NULL || heap->next != NULL || heap->end != USER_HEAP_BASE + 6 * PAGE_SIZE)
+        PANIC("[PROCESS-TESTS] Regrowing the heap didn't grow a single area!\n");
+    reap_process(proc);
+    printf("[PROCESS-TESTS] Done.\n");
+}
+
+#endif
@@ -3,31 +3,30 @@
 #include <riscv.h>
 #include <spinlock.h>
 
+// The value of `lk->hart` while this hart holds a lock. Never 0, which marks a free lock.
+static inline uint32_t owner_id(void) { return get_hart_local()->hartid + 1; }
+
 // Check whether this cpu is holding the lock.
 // Interrupts must be off.
 bool holding(struct spinlock *lk) {
-    struct hart_local *hart = get_hart_local();
-    return (lk->locked && lk->hart == hart->hartid);
+    // Only the owner ever stores its own id, so no other hart's acquire or release can make this true.
+    return __atomic_load_n(&lk->hart, __ATOMIC_RELAXED) == owner_id();
 }
 
-// Acquire the lock.
-// Loops (spins) until the lock is acquired.
-void acquire(struct spinlock *lk) {
-    push_off();
-    ;
-
+// Takes `lk` if nobody holds it, or nests if this hart already does. Interrupts must be off.
+static bool claim(struct spinlock *lk, bool spin) {
     if (holding(lk)) {
         lk->locked++;
-        __sync_synchronize();
-        return;
+        return true;
     }
 
-    // On RISC-V, sync_lock_test_and_set turns into an atomic swap:
-    //   a5 = 1
-    //   s1 = &lk->locked
-    //   amoswap.w.aq a5, a5, (s1)
-    while (__sync_lock_test_and_set(&lk->locked, 1) != 0)
-        ;
+    // Take ownership and record who has it in one step, so that there's no window in which the lock looks free or
+    // looks like another hart's. On RISC-V, this turns into an lr.w/sc.w loop.
+    const uint32_t owner = owner_id();
+    while (!__sync_bool_compare_and_swap(&lk->hart, 0, owner)) {
+        if (!spin)
+            return false;
+    }
 
     // Tell the C compiler and the processor to not move loads or stores
     // past this point, to ensure that the critical section's memory
@@ -35,22 +34,39 @@ void acquire(struct spinlock *lk) {
     // On RISC-V, this emits a fence instruction.
     __sync_synchronize();
 
-    // Record info about lock acquisition for holding() and debugging.
-    struct hart_local *hart = get_hart_local();
-    lk->hart = hart->hartid;
+    // Only the owner touches the nesting depth.
+    lk->locked = 1;
+    return true;
+}
+
+// Acquire the lock.
+// Loops (spins) until the lock is acquired.
+void acquire(struct spinlock *lk) {
+    push_off();
+    claim(lk, true);
+}
+
+// Like `acquire()`, but returns `false` instead of spinning if another hart holds the lock.
+bool try_acquire(struct spinlock *lk) {
+    push_off();
+    if (claim(lk, false))
+        return true;
+    pop_off();
+    return false;
 }
 
 void release(struct spinlock *lk) {
     if (!holding(lk))
         PANIC("Cannot release a lock you are not holding (%p).\n", __builtin_return_address(0));
 
+    // Every acquire pushed, so every release pops, nested or not.
     if (lk->locked > 1) {
-        __sync_synchronize();
         lk->locked--;
+        pop_off();
         return;
     }
 
-    lk->hart = 0;
+    lk->locked = 0;
 
     // Tell the C compiler and the CPU to not move loads or stores
     // past this point, to ensure that all the stores in the critical
@@ -60,14 +76,14 @@ void release(struct spinlock *lk) {
     // On RISC-V, this emits a fence instruction.
     __sync_synchronize();
 
-    // Release the lock, equivalent to lk->locked = 0.
+    // Release the lock, equivalent to lk->hart = 0.
     // This code doesn't use a C assignment, since the C standard
     // implies that an assignment might be implemented with
     // multiple store instructions.
     // On RISC-V, sync_lock_release turns into an atomic swap:
-    //   s1 = &lk->locked
+    //   s1 = &lk->hart
     //   amoswap.w zero, zero, (s1)
-    __sync_lock_release(&lk->locked);
+    __sync_lock_release(&lk->hart);
 
     pop_off();
 }
@@ -0,0 +1,142 @@
+#include <common.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+// Provided by the platform, see `user.h`.
+void *sbrk(int increment);
+
+// Small requests are rounded up to one of these size classes, each of which is carved out of spans of its own.
+#define MALLOC_SIZES X(16) X(32) X(48) X(64) X(96) X(128) X(192) X(256) X(384) X(512) X(768) X(1024) X(1536) X(2048)
+
+#define MALLOC_MAX_SMALL 2048
+
+// The heap is handed out in naturally aligned spans, so the span an object belongs to is found by aligning its address
+// down. Objects start after the span's header; large allocations get whole spans (of as many `MALLOC_SPAN_SIZE`s as
+// they need) to themselves.
+#define MALLOC_SPAN_SIZE   (16 * 1024)
+#define MALLOC_SPAN_HEADER 16
+#define MALLOC_LARGE_CLASS 0xff
+// `sbrk()` takes an `int`, so nothing this large could be satisfied anyway.
+#define MALLOC_MAX_LARGE   (1u << 30)
+
+enum malloc_class : uint8_t {
+#define X(SIZE) MALLOC_CLASS_##SIZE,
+    MALLOC_SIZES
+#undef X
+    MALLOC_CLASS_COUNT
+};
+
+static const uint16_t class_sizes[MALLOC_CLASS_COUNT] = {
+#define X(SIZE) SIZE,
+    MALLOC_SIZES
+#undef X
+};
+
+// The size class of every request up to `MALLOC_MAX_SMALL` bytes, indexed by its size in 16-byte steps.
+static const uint8_t class_lookup[MALLOC_MAX_SMALL / 16 + 1] = {
+    [0 ... 1] = MALLOC_CLASS_16,    [2] = MALLOC_CLASS_32,          [3] = MALLOC_CLASS_48,
+    [4] = MALLOC_CLASS_64,          [5 ... 6] = MALLOC_CLASS_96,    [7 ... 8] = MALLOC_CLASS_128,
+    [9 ... 12] = MALLOC_CLASS_192,  [13 ... 16] = MALLOC_CLASS_256, [17 ... 24] = MALLOC_CLASS_384,
+    [25 ... 32] = MALLOC_CLASS_512, [33 ... 48] = MALLOC_CLASS_768, [49 ... 64] = MALLOC_CLASS_1024,
+    [65 ... 96] = MALLOC_CLASS_1536, [97 ... 128] = MALLOC_CLASS_2048,
+};
+
+struct malloc_span {
+    uint8_t size_class;       // Or `MALLOC_LARGE_CLASS`.
+    size_t size;              // In bytes, header included.
+    struct malloc_span *next; // Free large spans only.
+};
+_Static_assert(sizeof(struct malloc_span) <= MALLOC_SPAN_HEADER, "Span header too large.");
+
+struct malloc_object {
+    struct malloc_object *next;
+};
+
+// Everything the fast paths touch. Meant to be one per thread, so that they never need a lock; for now there is only
+// the one thread, and the one cache. With more, freed objects would also need to drain back to a shared depot.
+struct malloc_cache {
+    struct malloc_object *free[MALLOC_CLASS_COUNT];
+    // The untouched tail of each class' newest span, handed out front to back so its pages are only faulted in as
+    // they're reached.
+    char *bump[MALLOC_CLASS_COUNT];
+    uint32_t bump_left[MALLOC_CLASS_COUNT];
+};
+
+static struct malloc_cache main_cache;
+static inline struct malloc_cache *current_cache(void) { return &main_cache; }
+
+// Freed large spans, kept for reuse rather than shrinking the heap.
+static struct malloc_span *free_large = NULL;
+
+static struct malloc_span *new_span(size_t size, uint8_t size_class) {
+    char *brk = sbrk(0);
+    const size_t pad = align_up((vaddr_t)brk, MALLOC_SPAN_SIZE) - (vaddr_t)brk;
+    if (sbrk((int)(pad + size)) == (void *)-1)
+        return NULL;
+    struct malloc_span *span = (struct malloc_span *)(brk + pad);
+    span->size_class = size_class;
+    span->size = size;
+    span->next = NULL;
+    return span;
+}
+
+static void *malloc_large(size_t size) {
+    if (size > MALLOC_MAX_LARGE)
+        return NULL;
+    size = align_up(size + MALLOC_SPAN_HEADER, MALLOC_SPAN_SIZE);
+    for (struct malloc_span **link = &free_large; *link != NULL; link = &(*link)->next) {
+        if ((*link)->size < size)
+            continue;
+        struct malloc_span *span = *link;
+        *link = span->next;
+        return (char *)span + MALLOC_SPAN_HEADER;
+    }
+    struct malloc_span *span = new_span(size, MALLOC_LARGE_CLASS);
+    return span != NULL ? (char *)span + MALLOC_SPAN_HEADER : NULL;
+}
+
+// Starts a new span for `size_class` once the cache has run out of both freed and untouched objects.
+static void *malloc_refill(struct malloc_cache *cache, uint8_t size_class) {
+    struct malloc_span *span = new_span(MALLOC_SPAN_SIZE, size_class);
+    if (span == NULL)
+        return NULL;
+    const uint16_t size = class_sizes[size_class];
+    cache->bump[size_class] = (char *)span + MALLOC_SPAN_HEADER + size;
+    cache->bump_left[size_class] = (MALLOC_SPAN_SIZE - MALLOC_SPAN_HEADER) / size - 1;
+    return (char *)span + MALLOC_SPAN_HEADER;
+}
+
+void *malloc(size_t size) {
+    if (size > MALLOC_MAX_SMALL)
+        return malloc_large(size);
+
+    struct malloc_cache *cache = current_cache();
+    const uint8_t size_class = class_lookup[(size + 15) / 16];
+    struct malloc_object *object = cache->free[size_class];
+    if (object != NULL) {
+        cache->free[size_class] = object->next;
+        return object;
+    }
+    if (cache->bump_left[size_class] > 0) {
+        cache->bump_left[size_class]--;
+        void *ptr = cache->bump[size_class];
+        cache->bump[size_class] += class_sizes[size_class];
+        return ptr;
+    }
+    return malloc_refill(cache, size_class);
+}
+
+void free(void *ptr) {
+    if (ptr == NULL)
+        return;
+    struct malloc_span *span = (struct malloc_span *)align_down((vaddr_t)ptr, MALLOC_SPAN_SIZE);
+    if (span->size_class == MALLOC_LARGE_CLASS) {
+        span->next = free_large;
+        free_large = span;
+        return;
+    }
+    struct malloc_cache *cache = current_cache();
+    struct malloc_object *object = ptr;
+    object->next = cache->free[span->size_class];
+    cache->free[span->size_class] = object;
+}
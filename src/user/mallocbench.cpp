@@ -0,0 +1,97 @@
+#include <cstdio>
+#include <cstdlib>
+
+extern "C" {
+#include <common.h>
+#include <user.h>
+}
+
+#define BENCH_ROUNDS 10000
+#define BENCH_BATCH  512
+
+static inline uint32_t now(void) {
+    uint32_t time;
+    __asm__ __volatile__("rdtime %0" : "=r"(time));
+    return time;
+}
+
+// Allocating and freeing one object over and over, which stays on the fast path after the first round.
+static void bench_pairs(size_t size) {
+    const uint32_t start = now();
+    for (size_t i = 0; i < BENCH_ROUNDS; i++) {
+        void *ptr = malloc(size);
+        if (ptr == nullptr) {
+            printf("[MALLOCBENCH] Out of memory allocating %zu bytes!\n", size);
+            exit();
+        }
+        *(volatile char *)ptr = (char)i;
+        free(ptr);
+    }
+    const uint32_t ticks = now() - start;
+    printf("[MALLOCBENCH] malloc/free of %zu bytes: %u ticks for %d pairs.\n", size, ticks, BENCH_ROUNDS);
+}
+
+// Allocating a whole batch before freeing any of it. The first round grows the heap, the second reuses what the first
+// freed. Each object is filled with its own index to catch any two overlapping.
+static void bench_batch(size_t size) {
+    static char *batch[BENCH_BATCH];
+    for (int round = 0; round < 2; round++) {
+        const uint32_t start = now();
+        for (size_t i = 0; i < BENCH_BATCH; i++) {
+            batch[i] = (char *)malloc(size);
+            if (batch[i] == nullptr) {
+                printf("[MALLOCBENCH] Out of memory after %zu objects of %zu bytes!\n", i, size);
+                exit();
+            }
+        }
+        const uint32_t alloc_ticks = now() - start;
+        for (size_t i = 0; i < BENCH_BATCH; i++)
+            memset(batch[i], (char)i, size);
+        for (size_t i = 0; i < BENCH_BATCH; i++) {
+            if (batch[i][0] != (char)i || batch[i][size - 1] != (char)i) {
+                printf("[MALLOCBENCH] Objects of %zu bytes overlap at %p!\n", size, batch[i]);
+                exit();
+            }
+        }
+        const uint32_t free_start = now();
+        for (size_t i = 0; i < BENCH_BATCH; i++)
+            free(batch[i]);
+        const uint32_t free_ticks = now() - free_start;
+        printf("[MALLOCBENCH] Batch of %d x %zu bytes (%s): %u ticks to allocate, %u ticks to free.\n", BENCH_BATCH,
+               size, round == 0 ? "fresh" : "reused", alloc_ticks, free_ticks);
+    }
+}
+
+struct node {
+    node *next;
+    uint32_t value;
+};
+
+// Building and tearing down a linked list through `new` and `delete`.
+static void bench_list(void) {
+    const uint32_t start = now();
+    node *head = nullptr;
+    for (uint32_t i = 0; i < BENCH_ROUNDS; i++)
+        head = new node{head, i};
+    uint32_t count = 0;
+    while (head != nullptr) {
+        node *next = head->next;
+        delete head;
+        head = next;
+        count++;
+    }
+    const uint32_t ticks = now() - start;
+    printf("[MALLOCBENCH] new/delete of a %u-node list: %u ticks.\n", count, ticks);
+}
+
+void main(void) {
+    const size_t sizes[] = {16, 64, 256, 2048, 8192};
+    void *before = sbrk(0);
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        bench_pairs(sizes[i]);
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        bench_batch(sizes[i]);
+    bench_list();
+    printf("[MALLOCBENCH] Done, the heap grew by %u bytes.\n", (uint32_t)((char *)sbrk(0) - (char *)before));
+    flush();
+}
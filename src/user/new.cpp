@@ -0,0 +1,18 @@
+#include <cstdlib>
+
+// The C++ allocation operators, on top of the stdlib heap. There are no exceptions to throw, so running out of memory
+// aborts.
+
+void *operator new(size_t size) {
+    void *ptr = malloc(size);
+    if (ptr == NULL)
+        abort();
+    return ptr;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete[](void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { free(ptr); }
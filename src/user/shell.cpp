@@ -8,14 +8,6 @@ extern "C" {
 void main(void);
 }
 
-// void *operator new(size_t size) {
-//     return (void*)1;
-// }
-
-// void delete(void*) {
-
-// }
-
 // class foo {int bar;};
 
 
@@ -65,6 +57,13 @@ void main(void) {
             int len = readfile("hello.txt", buf, sizeof(buf));
             buf[len] = '\0';
             printf("%S\n", buf);
+        } else if (IS("fork")) {
+            int pid = fork();
+            if (pid == 0) {
+                printf("Hello from the child!\n");
+                exit();
+            }
+            printf("Forked process %d.\n", pid);
         } else if (IS("writefile"))
             writefile("hello.txt", "Hello from shell!\n", 19);
         else
@@ -43,4 +43,6 @@ int writefile(const char *filename, const char *buf, int len) {
 }
 
 void yield(void) { syscall(SYS_YIELD, 0, 0, 0); }
+int fork(void) { return syscall(SYS_FORK, 0, 0, 0); }
+void *sbrk(int increment) { return (void *)syscall(SYS_SBRK, increment, 0, 0); }
 void flush(void) { syscall(SYS_FLUSH, 0, 0, 0); }